@@ -15,502 +15,5316 @@
  * Copyright (C) 2024 JUCR GmbH
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <glib.h>
 #include <glib-unix.h>
+#include <glib/gstdio.h>
+#include <gio/gunixsocketaddress.h>
 #include <libmm-glib.h>
 
+/* Defaults for settings in CONFIG_FILE.
+ *
+ * KICK_INTERVAL_SECONDS is the default threshold for idle and denied
+ * registration; other states don't trigger kicks unless configured to.
+ */
+#define CONFIG_FILE "/etc/modem-kick.conf"
+
 #ifdef DEBUG
-#define RESET_POLL_SECONDS 15
+#define KICK_REPEAT_SECONDS 15
+#define KICK_REPEAT_MAX_SECONDS 60
 #define KICK_INTERVAL_SECONDS 60  /* 1 minute */
 #else
-#define RESET_POLL_SECONDS 300
+#define KICK_REPEAT_SECONDS 300
+#define KICK_REPEAT_MAX_SECONDS 3600
 #define KICK_INTERVAL_SECONDS 605  /* 10 minutes + 5 seconds */
 #endif
 
-typedef struct ModemContext ModemContext;
+/* Longest wait between op states when ModemManager doesn't confirm a step */
+#define OP_STEP_SECONDS 10
+
+/* How long registration gets to recover after a kick before the next, more
+ * expensive recovery tier is tried.
+ */
+#ifdef DEBUG
+#define KICK_VERIFY_SECONDS 15
+#else
+#define KICK_VERIFY_SECONDS 60
+#endif
+
+/* Failed op states are retried after OP_STEP_SECONDS, backing off up to
+ * OP_RETRY_MAX_SECONDS, at most OP_MAX_TRIES times.
+ */
+#define OP_RETRY_MAX_SECONDS 60
+#define OP_MAX_TRIES 3
+
+/* A ModemManager call for an op state that hasn't returned after this long
+ * is canceled and counts as failed. Registering and enabling wait for the
+ * network, so they get as long as libmm-glib itself gives them.
+ */
+#define OP_TIMEOUT_SECONDS      30
+#define OP_LONG_TIMEOUT_SECONDS 120
+
+/* Backoff delays grow by this factor per attempt and are randomized by
+ * +/- this fraction so that modems hit by the same outage drift apart.
+ */
+#define BACKOFF_MULTIPLIER 2.0
+#define BACKOFF_JITTER     0.2
+
+/* While the modem reports zero signal quality a kick can't help, so kicks
+ * are postponed by this much (-1: not at all while there's no signal).
+ */
+#define NO_SIGNAL_DELAY_SECONDS 1800
+
+/* Once the network has refused registration for a reason only the operator
+ * can fix (unknown IMSI, illegal ME...), the modem is only re-registered
+ * every REJECT_HOLDOFF_SECONDS to find out whether it has been.
+ */
+#define REJECT_HOLDOFF_SECONDS 3600
+
+/* A modem that keeps dropping in and out of idle/denied is kicked once it
+ * has spent FLAP_THRESHOLD_SECONDS of the last FLAP_WINDOW_SECONDS there,
+ * even if no single stretch reached the state's threshold.
+ */
+#define FLAP_WINDOW_SECONDS    3600
+#define FLAP_THRESHOLD_SECONDS 900
+
+/* At most this many ModemManager calls for kicks are in flight at the same
+ * time; further steps wait their turn in the order they became due. A
+ * modem waiting between the steps of its kick doesn't hold a slot, so the
+ * kicks of several modems overlap.
+ */
+#define KICK_MAX_CONCURRENT 1
+
+/* When an outage ends, every modem on the cell hits its threshold at about
+ * the same time; kicking them all at once only gets them rejected for
+ * congestion again. Each modem's threshold is stretched by up to
+ * KICK_STAGGER_SECONDS, a fixed amount derived from its equipment
+ * identifier (the IMEI), and at most KICK_RATE kicks an hour may start,
+ * KICK_BURST of them back to back (KICK_RATE 0: no limit). A fleet agent
+ * can change the rate at runtime through the D-Bus KickRate property.
+ */
+#define KICK_STAGGER_SECONDS 60
+#define KICK_RATE            0
+#define KICK_BURST           3
+
+/* Once a recovery tier has been tried LEARN_MIN_KICKS times on a modem
+ * model and brought registration back in less than LEARN_MIN_SUCCESS of
+ * them, kicks on that model skip it.
+ */
+#define LEARN_MIN_KICKS   3
+#define LEARN_MIN_SUCCESS 0.25
+
+/* Unix socket serving metrics over HTTP; empty: no metrics endpoint. A
+ * client gets METRICS_TIMEOUT_SECONDS to send its request and take the
+ * response, and at most METRICS_MAX_CLIENTS are served at once.
+ */
+#define METRICS_SOCKET          ""
+#define METRICS_TIMEOUT_SECONDS 10
+#define METRICS_MAX_CLIENTS     4
+
+/* Whether to only build ModemManager proxies for the interfaces we use */
+#define MINIMAL_PROXIES FALSE
+
+/* Timers fire up to TIMER_SLACK_SECONDS late, on multiples of it, so that
+ * timers due close together share a wakeup (0: on time). Battery-backed
+ * sites can trade precision for fewer wakeups; none are periodic anyway,
+ * so with every modem registered the daemon only wakes for events.
+ */
+#define TIMER_SLACK_SECONDS 0
+
+/* Where failing modems' failure clocks outlive restarts; empty: nowhere */
+#define STATE_FILE "/var/lib/modem-kick/state"
+
+/* Executable asked before each kick whether it may go ahead, and told when
+ * it's over; empty: none. It gets HOOK_TIMEOUT_SECONDS to answer, after
+ * which the kick goes ahead. Exiting with HOOK_EXIT_DEFER (EX_TEMPFAIL)
+ * asks again after HOOK_DEFER_SECONDS; any other failure vetoes the kick
+ * until the [kick] repeat backoff has passed.
+ */
+#define HOOK_COMMAND         ""
+#define HOOK_TIMEOUT_SECONDS 30
+#define HOOK_DEFER_SECONDS   300
+#define HOOK_EXIT_DEFER      75
+
+/* At most LOG_BURST messages are logged per modem in LOG_INTERVAL_SECONDS,
+ * however noisy its radio; the rest are counted, which is reported with the
+ * first message of the next interval. Warnings aren't limited.
+ */
+#define LOG_BURST            20
+#define LOG_INTERVAL_SECONDS 600
+
+/* How the hardware tier cuts a modem's power when ModemManager can't get
+ * through to it any more: "gpio", "authorized", "command", or empty for no
+ * hardware tier. Power comes back after POWER_OFF_SECONDS.
+ */
+#define POWER_BACKEND     ""
+#define POWER_OFF_SECONDS 5
+
+/* A modem can stay registered while its data path is dead. With
+ * PROBE_INTERVAL_SECONDS set, a registered modem's connected bearer is
+ * probed that often: if its interface sent but received nothing since the
+ * last probe, and PROBE_COMMAND (if set) can't reach anything through it
+ * either, the modem counts as idle. Probes back off to
+ * PROBE_MAX_INTERVAL_SECONDS while data flows.
+ */
+#define PROBE_INTERVAL_SECONDS     0
+#define PROBE_MAX_INTERVAL_SECONDS 900
+#define PROBE_COMMAND              ""
+
+/*****************************************************************************/
+/* Deadline scheduler
+ *
+ * All kick and op-state deadlines live in one binary min-heap keyed by
+ * monotonic deadline. A single GSource is armed for the earliest one, so the
+ * number of main loop sources and wakeups stays flat as modems are added.
+ */
+
+/* In --replay mode time only moves when the replay advances it */
+static gboolean time_is_virtual;
+static gint64   virtual_time;
+
+static gint64
+get_monotonic_time (void)
+{
+    return time_is_virtual ? virtual_time : g_get_monotonic_time ();
+}
+
+typedef void (*TimerFunc) (gpointer user_data);
+
+#define TIMER_UNARMED G_MAXUINT
 
 typedef struct {
-    GDBusConnection *connection;
-    GMainLoop       *loop;
-    GCancellable    *cancellable;
-    MMManager       *mm;
+    gint64     deadline;  /* monotonic usec */
+    guint      index;     /* position in the heap, or TIMER_UNARMED */
+    TimerFunc  func;
+    gpointer   user_data;
+} Timer;
 
-    GHashTable *modems;
+typedef struct {
+    GSource    source;
+    GPtrArray *heap;
+    gint64     slack;    /* usec; ready times are rounded up to multiples */
+    guint64    wakeups;  /* dispatches, i.e. times the timers woke us up */
+} Scheduler;
 
-    guint name_owner_changed_id;
-    guint object_added_id;
-    guint object_removed_id;
+static void
+timer_init (Timer *timer, TimerFunc func, gpointer user_data)
+{
+    timer->deadline = 0;
+    timer->index = TIMER_UNARMED;
+    timer->func = func;
+    timer->user_data = user_data;
+}
 
-    guint reset_poll_id;
-} Context;
+static gboolean
+timer_is_armed (const Timer *timer)
+{
+    return timer->index != TIMER_UNARMED;
+}
 
-static Context *
-context_new (void)
+static Timer *
+scheduler_heap_get (Scheduler *sched, guint i)
 {
-    Context *ctx;
+    return g_ptr_array_index (sched->heap, i);
+}
 
-    ctx = g_slice_new0 (Context);
-    ctx->loop = g_main_loop_new (NULL, FALSE);
-    ctx->cancellable = g_cancellable_new ();
-    ctx->modems = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_object_unref);
-    return ctx;
+static void
+scheduler_heap_set (Scheduler *sched, guint i, Timer *timer)
+{
+    g_ptr_array_index (sched->heap, i) = timer;
+    timer->index = i;
 }
 
 static void
-context_clear_modems (Context *ctx)
+scheduler_sift_up (Scheduler *sched, guint i)
 {
-    g_message ("clearing modems");
-    g_hash_table_remove_all (ctx->modems);
+    Timer *timer = scheduler_heap_get (sched, i);
+
+    while (i > 0) {
+        guint  parent = (i - 1) / 2;
+        Timer *p = scheduler_heap_get (sched, parent);
+
+        if (p->deadline <= timer->deadline)
+            break;
+        scheduler_heap_set (sched, i, p);
+        i = parent;
+    }
+    scheduler_heap_set (sched, i, timer);
 }
 
 static void
-context_clear_manager (Context *ctx)
+scheduler_sift_down (Scheduler *sched, guint i)
 {
-    if (ctx->name_owner_changed_id) {
-        g_signal_handler_disconnect (ctx->mm, ctx->name_owner_changed_id);
-        ctx->name_owner_changed_id = 0;
+    Timer *timer = scheduler_heap_get (sched, i);
+    guint  len = sched->heap->len;
+
+    for (;;) {
+        guint  child = 2 * i + 1;
+        Timer *c;
+
+        if (child >= len)
+            break;
+        if (child + 1 < len &&
+            scheduler_heap_get (sched, child + 1)->deadline < scheduler_heap_get (sched, child)->deadline)
+            child++;
+        c = scheduler_heap_get (sched, child);
+        if (timer->deadline <= c->deadline)
+            break;
+        scheduler_heap_set (sched, i, c);
+        i = child;
     }
-    if (ctx->object_added_id) {
-        g_signal_handler_disconnect (ctx->mm, ctx->object_added_id);
-        ctx->object_added_id = 0;
+    scheduler_heap_set (sched, i, timer);
+}
+
+static void
+scheduler_update_ready_time (Scheduler *sched)
+{
+    gint64 ready;
+
+    if (sched->heap->len == 0) {
+        g_source_set_ready_time (&sched->source, -1);
+        return;
     }
-    if (ctx->object_removed_id) {
-        g_signal_handler_disconnect (ctx->mm, ctx->object_removed_id);
-        ctx->object_removed_id = 0;
+    /* every timer due by the rounded time fires in the same dispatch */
+    ready = scheduler_heap_get (sched, 0)->deadline;
+    if (sched->slack > 0)
+        ready = (ready + sched->slack - 1) / sched->slack * sched->slack;
+    g_source_set_ready_time (&sched->source, ready);
+}
+
+static void
+scheduler_remove (Scheduler *sched, Timer *timer)
+{
+    guint  i = timer->index;
+    Timer *last;
+
+    last = g_ptr_array_remove_index (sched->heap, sched->heap->len - 1);
+    timer->index = TIMER_UNARMED;
+    if (last != timer) {
+        scheduler_heap_set (sched, i, last);
+        scheduler_sift_up (sched, i);
+        scheduler_sift_down (sched, last->index);
     }
+}
 
-    g_clear_object (&ctx->mm);
+static void
+scheduler_cancel (Scheduler *sched, Timer *timer)
+{
+    if (!timer_is_armed (timer))
+        return;
+    scheduler_remove (sched, timer);
+    scheduler_update_ready_time (sched);
+}
 
-    context_clear_modems (ctx);
+/* (Re)arms @timer to fire at the monotonic time @deadline */
+static void
+scheduler_arm (Scheduler *sched, Timer *timer, gint64 deadline)
+{
+    if (timer_is_armed (timer))
+        scheduler_remove (sched, timer);
+
+    timer->deadline = deadline;
+    g_ptr_array_add (sched->heap, timer);
+    timer->index = sched->heap->len - 1;
+    scheduler_sift_up (sched, timer->index);
+    scheduler_update_ready_time (sched);
+}
+
+static gboolean
+scheduler_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+    Scheduler *sched = (Scheduler *) source;
+    gint64     now = g_source_get_time (source);
+
+    sched->wakeups++;
+    /* Timer functions may arm or cancel other timers, so pop before calling */
+    while (sched->heap->len > 0) {
+        Timer *timer = scheduler_heap_get (sched, 0);
+
+        if (timer->deadline > now)
+            break;
+        scheduler_remove (sched, timer);
+        timer->func (timer->user_data);
+    }
+
+    scheduler_update_ready_time (sched);
+    return G_SOURCE_CONTINUE;
 }
 
+/* Virtual time only: runs every timer due by @until in deadline order,
+ * moving the clock to each deadline in turn, then to @until.
+ */
 static void
-context_free (Context *ctx)
+scheduler_advance (Scheduler *sched, gint64 until)
 {
-    context_clear_manager (ctx);
+    g_assert (time_is_virtual);
 
-    if (ctx->reset_poll_id) {
-        g_source_remove (ctx->reset_poll_id);
-        ctx->reset_poll_id = 0;
+    while (sched->heap->len > 0) {
+        Timer *timer = scheduler_heap_get (sched, 0);
+
+        if (timer->deadline > until)
+            break;
+        virtual_time = MAX (virtual_time, timer->deadline);
+        scheduler_remove (sched, timer);
+        timer->func (timer->user_data);
     }
+    virtual_time = MAX (virtual_time, until);
+}
 
-    g_hash_table_destroy (ctx->modems);
-    g_cancellable_cancel (ctx->cancellable);
-    g_clear_object (&ctx->cancellable);
-    g_clear_object (&ctx->connection);
-    g_main_loop_unref (ctx->loop);
-    g_slice_free (Context, ctx);
+static void
+scheduler_finalize (GSource *source)
+{
+    Scheduler *sched = (Scheduler *) source;
+    guint      i;
+
+    for (i = 0; i < sched->heap->len; i++)
+        scheduler_heap_get (sched, i)->index = TIMER_UNARMED;
+    g_ptr_array_unref (sched->heap);
+}
+
+static GSourceFuncs scheduler_funcs = {
+    .dispatch = scheduler_dispatch,
+    .finalize = scheduler_finalize,
+};
+
+static Scheduler *
+scheduler_new (void)
+{
+    Scheduler *sched;
+
+    sched = (Scheduler *) g_source_new (&scheduler_funcs, sizeof (Scheduler));
+    sched->heap = g_ptr_array_new ();
+    g_source_set_name (&sched->source, "modem-kick scheduler");
+    g_source_set_ready_time (&sched->source, -1);
+    g_source_attach (&sched->source, NULL);
+    return sched;
+}
+
+static void
+scheduler_set_slack (Scheduler *sched, guint seconds)
+{
+    sched->slack = (gint64) seconds * G_USEC_PER_SEC;
+    scheduler_update_ready_time (sched);
+}
+
+static void
+scheduler_free (Scheduler *sched)
+{
+    g_source_destroy (&sched->source);
+    g_source_unref (&sched->source);
+}
+
+/*****************************************************************************/
+/* Exponential backoff with jitter */
+
+typedef struct {
+    gint64  base;        /* usec */
+    gint64  max;         /* usec */
+    gdouble multiplier;
+    gdouble jitter;      /* fraction of the delay, 0..1 */
+    guint   attempts;
+} Backoff;
+
+/* Changes the policy; attempts made so far still count */
+static void
+backoff_configure (Backoff *backoff, guint base_seconds, guint max_seconds, gdouble multiplier, gdouble jitter)
+{
+    backoff->base = (gint64) base_seconds * G_USEC_PER_SEC;
+    backoff->max = (gint64) max_seconds * G_USEC_PER_SEC;
+    backoff->multiplier = multiplier;
+    backoff->jitter = jitter;
+}
+
+static void
+backoff_init (Backoff *backoff, guint base_seconds, guint max_seconds, gdouble multiplier, gdouble jitter)
+{
+    backoff_configure (backoff, base_seconds, max_seconds, multiplier, jitter);
+    backoff->attempts = 0;
+}
+
+static void
+backoff_reset (Backoff *backoff)
+{
+    backoff->attempts = 0;
+}
+
+/* Returns the delay (usec) before the next attempt and counts the attempt.
+ * Jitter stays below the max, so delays at the cap only spread downwards.
+ */
+static gint64
+backoff_next (Backoff *backoff)
+{
+    gdouble delay = backoff->base;
+    guint   i;
+
+    for (i = 0; i < backoff->attempts && delay < backoff->max; i++)
+        delay *= backoff->multiplier;
+    delay = MIN (delay, (gdouble) backoff->max);
+    if (backoff->jitter > 0)
+        delay = g_random_double_range (delay * (1.0 - backoff->jitter),
+                                       MIN (delay * (1.0 + backoff->jitter), (gdouble) backoff->max));
+
+    backoff->attempts++;
+    return MAX ((gint64) delay, G_USEC_PER_SEC);
 }
 
 /*****************************************************************************/
+/* Token bucket: holds up to a burst of tokens, refilled at a steady rate */
+
+typedef struct {
+    gdouble tokens;
+    gint64  updated;  /* monotonic time tokens was last refilled */
+} TokenBucket;
+
+/* Takes a token if there is one and returns 0; otherwise returns how long
+ * (usec) until the next one. A full bucket on first use.
+ */
+static gint64
+token_bucket_take (TokenBucket *bucket, gdouble per_second, guint burst, gint64 now)
+{
+    if (bucket->updated == 0)
+        bucket->tokens = burst;
+    else
+        bucket->tokens = MIN (bucket->tokens + per_second * (now - bucket->updated) / G_USEC_PER_SEC, (gdouble) burst);
+    bucket->updated = now;
 
-static void modem_registration_changed (MMModem3gpp *modem_3gpp, GParamSpec *pspec, MMObject *modem_object);
+    if (bucket->tokens >= 1.0) {
+        bucket->tokens -= 1.0;
+        return 0;
+    }
+    return MAX ((gint64) ((1.0 - bucket->tokens) / per_second * G_USEC_PER_SEC), 1);
+}
+
+/*****************************************************************************/
+/* Op states and recovery tiers */
 
 typedef enum {
     MODEM_OP_STATE_NONE = 0,
+    MODEM_OP_STATE_REGISTER,
     MODEM_OP_STATE_DISABLE,
     MODEM_OP_STATE_LOW_POWER,
     MODEM_OP_STATE_ENABLE,
+    MODEM_OP_STATE_RESET,
+    MODEM_OP_STATE_CUT_POWER,
     MODEM_OP_STATE_FINISH,
 } OpState;
 
-struct ModemContext {
-    const gchar *path;
-    MMModem     *modem;
-    MMModem3gpp *modem_3gpp;
+/* Recovery ladder: each kick runs one tier's op state sequence, starting
+ * with the cheapest. If registration hasn't recovered KICK_VERIFY_SECONDS
+ * after a kick (or a step of the tier keeps failing) the next kick uses the
+ * next tier. The last tier is repeated with backoff until the modem
+ * registers, which resets the ladder. The hardware tier, which goes around
+ * ModemManager, is only used once a power backend is configured.
+ */
+typedef enum {
+    KICK_TIER_REGISTER = 0,
+    KICK_TIER_REENABLE,
+    KICK_TIER_POWER_CYCLE,
+    KICK_TIER_RESET,
+    KICK_TIER_HARDWARE,
+} KickTier;
 
-    guint reg_state_changed_id;
+#define KICK_TIER_LAST KICK_TIER_HARDWARE
 
-    /* monotonic timestamp when modem was last idle/denied; set to 0 when modem
-     * enters a registration state other than idle/denied.
-     */
-    gint64 timestamp;
+static const OpState tier_register_steps[] = {
+    MODEM_OP_STATE_REGISTER, MODEM_OP_STATE_FINISH,
+};
+static const OpState tier_reenable_steps[] = {
+    MODEM_OP_STATE_DISABLE, MODEM_OP_STATE_ENABLE, MODEM_OP_STATE_FINISH,
+};
+static const OpState tier_power_cycle_steps[] = {
+    MODEM_OP_STATE_DISABLE, MODEM_OP_STATE_LOW_POWER, MODEM_OP_STATE_ENABLE, MODEM_OP_STATE_FINISH,
+};
+static const OpState tier_reset_steps[] = {
+    MODEM_OP_STATE_RESET, MODEM_OP_STATE_FINISH,
+};
+static const OpState tier_hardware_steps[] = {
+    MODEM_OP_STATE_CUT_POWER, MODEM_OP_STATE_FINISH,
+};
 
-    /* Created & used each time modem needs a kick */
-    GCancellable *cancellable;
+static const struct {
+    const gchar   *name;
+    const OpState *steps;  /* terminated by MODEM_OP_STATE_FINISH */
+} kick_tiers[] = {
+    [KICK_TIER_REGISTER]    = { "re-register", tier_register_steps },
+    [KICK_TIER_REENABLE]    = { "re-enable",   tier_reenable_steps },
+    [KICK_TIER_POWER_CYCLE] = { "power-cycle", tier_power_cycle_steps },
+    [KICK_TIER_RESET]       = { "reset",       tier_reset_steps },
+    [KICK_TIER_HARDWARE]    = { "hardware",    tier_hardware_steps },
+};
+
+#define N_KICK_TIERS (KICK_TIER_LAST + 1)
+
+/* How each tier's kicks went on one modem model: a kick succeeds if the
+ * modem registers before its verify window is over
+ */
+typedef struct {
+    guint successes[N_KICK_TIERS];
+    guint failures[N_KICK_TIERS];
+} ModelStats;
 
-    OpState op_state;
-    guint   next_id;
-    guint   tries;
+#define N_OP_STATES  (MODEM_OP_STATE_FINISH + 1)
+
+/* names of the op states that talk to ModemManager, as used in metrics */
+static const gchar *op_state_names[N_OP_STATES] = {
+    [MODEM_OP_STATE_REGISTER]  = "register",
+    [MODEM_OP_STATE_DISABLE]   = "disable",
+    [MODEM_OP_STATE_LOW_POWER] = "low-power",
+    [MODEM_OP_STATE_ENABLE]    = "enable",
+    [MODEM_OP_STATE_RESET]     = "reset",
+    [MODEM_OP_STATE_CUT_POWER] = "cut-power",
 };
 
-static ModemContext *
-get_modem_context (MMObject *obj)
+/*****************************************************************************/
+/* Configuration */
+
+/* Registration states that can trigger a kick once the modem has been in
+ * them for longer than the configured threshold.
+ */
+static const struct {
+    MMModem3gppRegistrationState  reg_state;
+    const gchar                  *name;
+    guint                         default_threshold;  /* seconds; 0 = never kick */
+} kick_thresholds[] = {
+    { MM_MODEM_3GPP_REGISTRATION_STATE_IDLE,      "idle",      KICK_INTERVAL_SECONDS },
+    { MM_MODEM_3GPP_REGISTRATION_STATE_DENIED,    "denied",    KICK_INTERVAL_SECONDS },
+    { MM_MODEM_3GPP_REGISTRATION_STATE_SEARCHING, "searching", 0 },
+    { MM_MODEM_3GPP_REGISTRATION_STATE_UNKNOWN,   "unknown",   0 },
+};
+
+#define N_KICK_THRESHOLDS G_N_ELEMENTS (kick_thresholds)
+
+/* What kicking can do about the cause the network gave for refusing
+ * registration. ModemManager reports it as the error of a failed
+ * re-register; causes not listed here say nothing and leave the ladder be.
+ */
+typedef enum {
+    REJECT_TEMPORARY,  /* congestion and the like: re-registering is enough */
+    REJECT_PERMANENT,  /* subscription or device refused: no kick will help */
+} RejectAction;
+
+typedef struct {
+    MMMobileEquipmentError  code;
+    const gchar            *name;
+    RejectAction            action;
+} RejectCause;
+
+static const RejectCause reject_causes[] = {
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_IMSI_UNKNOWN_IN_HLR,              "imsi-unknown",         REJECT_PERMANENT },
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_ILLEGAL_MS,                       "illegal-ms",           REJECT_PERMANENT },
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_ILLEGAL_ME,                       "illegal-me",           REJECT_PERMANENT },
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_SERVICE_NOT_ALLOWED,              "gprs-not-allowed",     REJECT_PERMANENT },
+    /* the network has barred the SIM; asking it again won't change that */
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_PLMN_NOT_ALLOWED,                 "plmn-not-allowed",     REJECT_PERMANENT },
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_LOCATION_NOT_ALLOWED,             "location-not-allowed", REJECT_TEMPORARY },
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_ROAMING_NOT_ALLOWED,              "roaming-not-allowed",  REJECT_TEMPORARY },
+#if MM_CHECK_VERSION (1, 20, 0)
+    /* libmm-glib before 1.20 lacks these; built against it, they say nothing */
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_AND_NON_GPRS_SERVICES_NOT_ALLOWED, "services-not-allowed", REJECT_PERMANENT },
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_NO_CELLS_IN_LOCATION_AREA,        "no-cells",             REJECT_TEMPORARY },
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_NETWORK_FAILURE,                  "network-failure",      REJECT_TEMPORARY },
+    { MM_MOBILE_EQUIPMENT_ERROR_GPRS_CONGESTION,                       "congestion",           REJECT_TEMPORARY },
+#endif
+};
+
+static const RejectCause *
+reject_cause_from_error (const GError *error)
 {
-    return g_object_get_data (G_OBJECT (obj), "modem-context");
+    guint i;
+
+    if (error->domain != MM_MOBILE_EQUIPMENT_ERROR)
+        return NULL;
+    for (i = 0; i < G_N_ELEMENTS (reject_causes); i++) {
+        if ((gint) reject_causes[i].code == error->code)
+            return &reject_causes[i];
+    }
+    return NULL;
 }
 
-static ModemContext *
-modem_context_new (MMObject *modem_object, MMModem *modem, MMModem3gpp *modem_3gpp)
+/* Settings for the modems whose manufacturer, model and firmware revision
+ * match the globs (NULL matches anything). Unset values (-1, tiers 0) fall
+ * back to the global ones.
+ */
+typedef struct {
+    gchar *name;
+    gchar *manufacturer;
+    gchar *model;
+    gchar *revision;
+    gint   thresholds[N_KICK_THRESHOLDS];
+    gint   step_delay;
+    gint   retry_max;
+    guint  tiers;  /* bit per KickTier */
+} Profile;
+
+static void
+profile_free (Profile *profile)
 {
-    ModemContext *modem_ctx;
+    g_free (profile->name);
+    g_free (profile->manufacturer);
+    g_free (profile->model);
+    g_free (profile->revision);
+    g_slice_free (Profile, profile);
+}
+
+static gboolean
+profile_match_one (const gchar *pattern, const gchar *value)
+{
+    return !pattern || g_pattern_match_simple (pattern, value ? value : "");
+}
+
+static gboolean
+profile_matches (const Profile *profile, const gchar *manufacturer, const gchar *model, const gchar *revision)
+{
+    return (profile_match_one (profile->manufacturer, manufacturer) &&
+            profile_match_one (profile->model, model) &&
+            profile_match_one (profile->revision, revision));
+}
+
+typedef struct {
+    gint    thresholds[N_KICK_THRESHOLDS];  /* seconds, indexed like kick_thresholds */
+    gint    verify;            /* KICK_VERIFY_SECONDS */
+    gint    repeat;            /* KICK_REPEAT_SECONDS */
+    gint    repeat_max;        /* KICK_REPEAT_MAX_SECONDS */
+    gint    step_delay;        /* OP_STEP_SECONDS */
+    gint    retry_max;         /* OP_RETRY_MAX_SECONDS */
+    gint    max_tries;         /* OP_MAX_TRIES */
+    gint    step_timeout;      /* OP_TIMEOUT_SECONDS */
+    gint    register_timeout;  /* OP_LONG_TIMEOUT_SECONDS */
+    gint    enable_timeout;    /* OP_LONG_TIMEOUT_SECONDS */
+    gdouble multiplier;        /* BACKOFF_MULTIPLIER */
+    gdouble jitter;            /* BACKOFF_JITTER */
+    gint    no_signal_delay;   /* NO_SIGNAL_DELAY_SECONDS */
+    gint    reject_holdoff;    /* REJECT_HOLDOFF_SECONDS */
+    gint    flap_window;       /* FLAP_WINDOW_SECONDS */
+    gint    flap_threshold;    /* FLAP_THRESHOLD_SECONDS; 0: off */
+    gint    max_concurrent;    /* KICK_MAX_CONCURRENT */
+    gint    stagger;           /* KICK_STAGGER_SECONDS */
+    gdouble kick_rate;         /* KICK_RATE, kicks an hour */
+    gint    kick_burst;        /* KICK_BURST */
+    gchar  *metrics_socket;    /* METRICS_SOCKET */
+    gchar  *state_file;        /* STATE_FILE */
+    gboolean minimal_proxies;  /* MINIMAL_PROXIES */
+    gchar  *hook;              /* HOOK_COMMAND */
+    gint    hook_timeout;      /* HOOK_TIMEOUT_SECONDS */
+    gint    hook_defer;        /* HOOK_DEFER_SECONDS */
+    gint    log_burst;         /* LOG_BURST; 0: no limit */
+    gint    log_interval;      /* LOG_INTERVAL_SECONDS */
+    gint    timer_slack;       /* TIMER_SLACK_SECONDS */
+    gchar  *power_backend;     /* POWER_BACKEND */
+    gchar  *power_gpio;        /* "gpio": value attribute of the line */
+    gboolean power_gpio_active_low;
+    gchar  *power_command;     /* "command": run with device and off time */
+    gint    power_off_time;    /* POWER_OFF_SECONDS */
+    gint    probe_interval;    /* PROBE_INTERVAL_SECONDS; 0: off */
+    gint    probe_max_interval;  /* PROBE_MAX_INTERVAL_SECONDS */
+    gchar  *probe_command;     /* PROBE_COMMAND: run with interface and modem */
+    GPtrArray *profiles;       /* Profile, first match wins */
+} Config;
+
+static void
+config_init (Config *config)
+{
+    guint i;
+
+    for (i = 0; i < N_KICK_THRESHOLDS; i++)
+        config->thresholds[i] = kick_thresholds[i].default_threshold;
+    config->verify = KICK_VERIFY_SECONDS;
+    config->repeat = KICK_REPEAT_SECONDS;
+    config->repeat_max = KICK_REPEAT_MAX_SECONDS;
+    config->step_delay = OP_STEP_SECONDS;
+    config->retry_max = OP_RETRY_MAX_SECONDS;
+    config->max_tries = OP_MAX_TRIES;
+    config->step_timeout = OP_TIMEOUT_SECONDS;
+    config->register_timeout = OP_LONG_TIMEOUT_SECONDS;
+    config->enable_timeout = OP_LONG_TIMEOUT_SECONDS;
+    config->multiplier = BACKOFF_MULTIPLIER;
+    config->jitter = BACKOFF_JITTER;
+    config->no_signal_delay = NO_SIGNAL_DELAY_SECONDS;
+    config->reject_holdoff = REJECT_HOLDOFF_SECONDS;
+    config->flap_window = FLAP_WINDOW_SECONDS;
+    config->flap_threshold = FLAP_THRESHOLD_SECONDS;
+    config->max_concurrent = KICK_MAX_CONCURRENT;
+    config->stagger = KICK_STAGGER_SECONDS;
+    config->kick_rate = KICK_RATE;
+    config->kick_burst = KICK_BURST;
+    config->metrics_socket = g_strdup (METRICS_SOCKET);
+    config->state_file = g_strdup (STATE_FILE);
+    config->minimal_proxies = MINIMAL_PROXIES;
+    config->hook = g_strdup (HOOK_COMMAND);
+    config->hook_timeout = HOOK_TIMEOUT_SECONDS;
+    config->hook_defer = HOOK_DEFER_SECONDS;
+    config->log_burst = LOG_BURST;
+    config->log_interval = LOG_INTERVAL_SECONDS;
+    config->timer_slack = TIMER_SLACK_SECONDS;
+    config->power_backend = g_strdup (POWER_BACKEND);
+    config->power_gpio = NULL;
+    config->power_gpio_active_low = FALSE;
+    config->power_command = NULL;
+    config->power_off_time = POWER_OFF_SECONDS;
+    config->probe_interval = PROBE_INTERVAL_SECONDS;
+    config->probe_max_interval = PROBE_MAX_INTERVAL_SECONDS;
+    config->probe_command = g_strdup (PROBE_COMMAND);
+    config->profiles = g_ptr_array_new_with_free_func ((GDestroyNotify) profile_free);
+}
+
+static void
+config_clear (Config *config)
+{
+    g_clear_pointer (&config->metrics_socket, g_free);
+    g_clear_pointer (&config->state_file, g_free);
+    g_clear_pointer (&config->hook, g_free);
+    g_clear_pointer (&config->power_backend, g_free);
+    g_clear_pointer (&config->power_gpio, g_free);
+    g_clear_pointer (&config->power_command, g_free);
+    g_clear_pointer (&config->probe_command, g_free);
+    g_clear_pointer (&config->profiles, g_ptr_array_unref);
+}
+
+/* Returns the first profile matching the modem, or NULL */
+static const Profile *
+config_match_profile (const Config *config, const gchar *manufacturer, const gchar *model, const gchar *revision)
+{
+    guint i;
+
+    for (i = 0; i < config->profiles->len; i++) {
+        const Profile *profile = g_ptr_array_index (config->profiles, i);
+
+        if (profile_matches (profile, manufacturer, model, revision))
+            return profile;
+    }
+    return NULL;
+}
+
+/* Returns how long (seconds) a modem may stay in @reg_state before it gets
+ * kicked, or 0 if the state never triggers a kick.
+ */
+static guint
+thresholds_get (const gint thresholds[N_KICK_THRESHOLDS], MMModem3gppRegistrationState reg_state)
+{
+    guint i;
+
+    for (i = 0; i < N_KICK_THRESHOLDS; i++) {
+        if (kick_thresholds[i].reg_state == reg_state && thresholds[i] > 0)
+            return thresholds[i];
+    }
+
+#ifdef DEBUG
+    /* Treat every state as failed so the op state machine gets exercised */
+    return KICK_INTERVAL_SECONDS;
+#else
+    return 0;
+#endif
+}
+
+static gboolean
+config_validate (const Config *config, GError **error)
+{
+    guint i;
+
+    for (i = 0; i < N_KICK_THRESHOLDS; i++) {
+        if (config->thresholds[i] < 0) {
+            g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                         "%s threshold must not be negative", kick_thresholds[i].name);
+            return FALSE;
+        }
+    }
+    if (config->verify < 0 || config->repeat < 1 || config->repeat_max < config->repeat ||
+        config->step_delay < 1 || config->retry_max < config->step_delay || config->max_tries < 0 ||
+        config->step_timeout < 1 || config->register_timeout < 1 || config->enable_timeout < 1 ||
+        config->reject_holdoff < 1 ||
+        config->max_concurrent < 1 || config->stagger < 0 || config->stagger > 86400 ||
+        !isfinite (config->kick_rate) || config->kick_rate < 0 || config->kick_burst < 1 || config->hook_timeout < 1 || config->hook_defer < 1 ||
+        config->log_burst < 0 || config->log_interval < 1 ||
+        config->timer_slack < 0 || config->timer_slack > 3600) {
+        g_set_error_literal (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                             "invalid kick timing: delays must be positive and maximums not below their base");
+        return FALSE;
+    }
+    if (config->no_signal_delay < -1) {
+        g_set_error_literal (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                             "invalid no-signal delay: must be -1 or more");
+        return FALSE;
+    }
+    if (config->flap_threshold < 0 || config->flap_window < config->flap_threshold) {
+        g_set_error_literal (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                             "invalid flapping detection: threshold must not be negative nor exceed the window");
+        return FALSE;
+    }
+    if (config->multiplier < 1.0 || config->jitter < 0.0 || config->jitter >= 1.0) {
+        g_set_error_literal (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                             "invalid backoff: multiplier must be at least 1 and jitter in [0, 1)");
+        return FALSE;
+    }
+    if (!g_str_equal (config->power_backend, "") &&
+        !(g_str_equal (config->power_backend, "gpio") && config->power_gpio && *config->power_gpio) &&
+        !g_str_equal (config->power_backend, "authorized") &&
+        !(g_str_equal (config->power_backend, "command") && config->power_command && *config->power_command)) {
+        g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                     "invalid power backend '%s': must be gpio (with gpio set), authorized, or command (with command set)",
+                     config->power_backend);
+        return FALSE;
+    }
+    if (config->power_off_time < 1) {
+        g_set_error_literal (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                             "invalid power off-time: must be positive");
+        return FALSE;
+    }
+    if (config->probe_interval < 0 ||
+        (config->probe_interval > 0 && config->probe_max_interval < config->probe_interval)) {
+        g_set_error_literal (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                             "invalid probe interval: must not be negative, and max-interval not below it");
+        return FALSE;
+    }
+    for (i = 0; i < config->profiles->len; i++) {
+        const Profile *profile = g_ptr_array_index (config->profiles, i);
+        gint           step_delay = profile->step_delay >= 0 ? profile->step_delay : config->step_delay;
+        gint           retry_max = profile->retry_max >= 0 ? profile->retry_max : config->retry_max;
+
+        if (step_delay < 1 || retry_max < step_delay) {
+            g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                         "profile %s: step delay must be positive and retry-max not below it", profile->name);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Reads @group/@key into @value if present; a missing key keeps the default */
+static gboolean
+config_read_int (GKeyFile *keyfile, const gchar *group, const gchar *key, gint *value, GError **error)
+{
+    GError *local_error = NULL;
+    gint    v;
+
+    if (!g_key_file_has_key (keyfile, group, key, NULL))
+        return TRUE;
+
+    v = g_key_file_get_integer (keyfile, group, key, &local_error);
+    if (local_error) {
+        g_propagate_error (error, local_error);
+        return FALSE;
+    }
+    *value = v;
+    return TRUE;
+}
+
+static gboolean
+config_read_double (GKeyFile *keyfile, const gchar *group, const gchar *key, gdouble *value, GError **error)
+{
+    GError  *local_error = NULL;
+    gdouble  v;
+
+    if (!g_key_file_has_key (keyfile, group, key, NULL))
+        return TRUE;
+
+    v = g_key_file_get_double (keyfile, group, key, &local_error);
+    if (local_error) {
+        g_propagate_error (error, local_error);
+        return FALSE;
+    }
+    *value = v;
+    return TRUE;
+}
+
+static gboolean
+config_read_boolean (GKeyFile *keyfile, const gchar *group, const gchar *key, gboolean *value, GError **error)
+{
+    GError   *local_error = NULL;
+    gboolean  v;
+
+    if (!g_key_file_has_key (keyfile, group, key, NULL))
+        return TRUE;
+
+    v = g_key_file_get_boolean (keyfile, group, key, &local_error);
+    if (local_error) {
+        g_propagate_error (error, local_error);
+        return FALSE;
+    }
+    *value = v;
+    return TRUE;
+}
+
+static gboolean
+config_read_string (GKeyFile *keyfile, const gchar *group, const gchar *key, gchar **value, GError **error)
+{
+    GError *local_error = NULL;
+    gchar  *v;
+
+    if (!g_key_file_has_key (keyfile, group, key, NULL))
+        return TRUE;
+
+    v = g_key_file_get_string (keyfile, group, key, &local_error);
+    if (local_error) {
+        g_propagate_error (error, local_error);
+        return FALSE;
+    }
+    g_free (*value);
+    *value = v;
+    return TRUE;
+}
+
+static gboolean
+config_read_tiers (GKeyFile *keyfile, const gchar *group, guint *tiers, GError **error)
+{
+    g_auto(GStrv) names = NULL;
+    GError       *local_error = NULL;
+    guint         i;
+
+    if (!g_key_file_has_key (keyfile, group, "tiers", NULL))
+        return TRUE;
+
+    names = g_key_file_get_string_list (keyfile, group, "tiers", NULL, &local_error);
+    if (local_error) {
+        g_propagate_error (error, local_error);
+        return FALSE;
+    }
+    *tiers = 0;
+    for (i = 0; names[i]; i++) {
+        guint tier;
+
+        for (tier = 0; tier < N_KICK_TIERS; tier++) {
+            if (g_str_equal (kick_tiers[tier].name, names[i]))
+                break;
+        }
+        if (tier == N_KICK_TIERS) {
+            g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                         "[%s]: unknown tier '%s'", group, names[i]);
+            return FALSE;
+        }
+        *tiers |= 1u << tier;
+    }
+    if (*tiers == 0) {
+        g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "[%s]: no tiers given", group);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Reads a "[profile <name>]" group */
+static gboolean
+config_read_profile (Config *config, GKeyFile *keyfile, const gchar *group, GError **error)
+{
+    Profile *profile;
+    guint    i;
+
+    profile = g_slice_new0 (Profile);
+    profile->name = g_strdup (group + strlen ("profile "));
+    for (i = 0; i < N_KICK_THRESHOLDS; i++)
+        profile->thresholds[i] = -1;
+    profile->step_delay = -1;
+    profile->retry_max = -1;
+    g_ptr_array_add (config->profiles, profile);
+
+    for (i = 0; i < N_KICK_THRESHOLDS; i++) {
+        if (!config_read_int (keyfile, group, kick_thresholds[i].name, &profile->thresholds[i], error))
+            return FALSE;
+    }
+    return (config_read_string (keyfile, group, "manufacturer", &profile->manufacturer, error) &&
+            config_read_string (keyfile, group, "model", &profile->model, error) &&
+            config_read_string (keyfile, group, "revision", &profile->revision, error) &&
+            config_read_int (keyfile, group, "delay", &profile->step_delay, error) &&
+            config_read_int (keyfile, group, "retry-max", &profile->retry_max, error) &&
+            config_read_tiers (keyfile, group, &profile->tiers, error));
+}
+
+/* Overlays the settings found in @path on @config. A missing file is not an
+ * error; every setting then keeps its default.
+ */
+static gboolean
+config_load_file (Config *config, const gchar *path, GError **error)
+{
+    g_autoptr(GKeyFile) keyfile = NULL;
+    g_auto(GStrv)       groups = NULL;
+    GError             *local_error = NULL;
+    guint               i;
+
+    keyfile = g_key_file_new ();
+    if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, &local_error)) {
+        if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_message ("%s not found; using defaults", path);
+            g_error_free (local_error);
+            return TRUE;
+        }
+        g_propagate_error (error, local_error);
+        return FALSE;
+    }
+
+    for (i = 0; i < N_KICK_THRESHOLDS; i++) {
+        if (!config_read_int (keyfile, "thresholds", kick_thresholds[i].name, &config->thresholds[i], error))
+            return FALSE;
+    }
+
+    groups = g_key_file_get_groups (keyfile, NULL);
+    for (i = 0; groups[i]; i++) {
+        if (g_str_has_prefix (groups[i], "profile ") &&
+            !config_read_profile (config, keyfile, groups[i], error))
+            return FALSE;
+    }
+
+    return (config_read_int (keyfile, "kick", "verify", &config->verify, error) &&
+            config_read_int (keyfile, "kick", "repeat", &config->repeat, error) &&
+            config_read_int (keyfile, "kick", "repeat-max", &config->repeat_max, error) &&
+            config_read_int (keyfile, "kick", "max-concurrent", &config->max_concurrent, error) &&
+            config_read_int (keyfile, "kick", "stagger", &config->stagger, error) &&
+            config_read_double (keyfile, "kick", "rate", &config->kick_rate, error) &&
+            config_read_int (keyfile, "kick", "burst", &config->kick_burst, error) &&
+            config_read_int (keyfile, "steps", "delay", &config->step_delay, error) &&
+            config_read_int (keyfile, "steps", "retry-max", &config->retry_max, error) &&
+            config_read_int (keyfile, "steps", "tries", &config->max_tries, error) &&
+            config_read_int (keyfile, "steps", "timeout", &config->step_timeout, error) &&
+            config_read_int (keyfile, "steps", "register-timeout", &config->register_timeout, error) &&
+            config_read_int (keyfile, "steps", "enable-timeout", &config->enable_timeout, error) &&
+            config_read_double (keyfile, "backoff", "multiplier", &config->multiplier, error) &&
+            config_read_double (keyfile, "backoff", "jitter", &config->jitter, error) &&
+            config_read_int (keyfile, "signal", "no-signal-delay", &config->no_signal_delay, error) &&
+            config_read_int (keyfile, "reject", "holdoff", &config->reject_holdoff, error) &&
+            config_read_int (keyfile, "flapping", "window", &config->flap_window, error) &&
+            config_read_int (keyfile, "flapping", "threshold", &config->flap_threshold, error) &&
+            config_read_string (keyfile, "metrics", "socket", &config->metrics_socket, error) &&
+            config_read_string (keyfile, "state", "file", &config->state_file, error) &&
+            config_read_boolean (keyfile, "modemmanager", "minimal-proxies", &config->minimal_proxies, error) &&
+            config_read_string (keyfile, "hook", "command", &config->hook, error) &&
+            config_read_int (keyfile, "hook", "timeout", &config->hook_timeout, error) &&
+            config_read_int (keyfile, "hook", "defer", &config->hook_defer, error) &&
+            config_read_int (keyfile, "log", "burst", &config->log_burst, error) &&
+            config_read_int (keyfile, "log", "interval", &config->log_interval, error) &&
+            config_read_int (keyfile, "timers", "slack", &config->timer_slack, error) &&
+            config_read_string (keyfile, "power", "backend", &config->power_backend, error) &&
+            config_read_string (keyfile, "power", "gpio", &config->power_gpio, error) &&
+            config_read_boolean (keyfile, "power", "gpio-active-low", &config->power_gpio_active_low, error) &&
+            config_read_string (keyfile, "power", "command", &config->power_command, error) &&
+            config_read_int (keyfile, "power", "off-time", &config->power_off_time, error) &&
+            config_read_int (keyfile, "probe", "interval", &config->probe_interval, error) &&
+            config_read_int (keyfile, "probe", "max-interval", &config->probe_max_interval, error) &&
+            config_read_string (keyfile, "probe", "command", &config->probe_command, error));
+}
+
+/*****************************************************************************/
+
+typedef struct ModemContext ModemContext;
+typedef struct Metrics Metrics;
+
+/* Stands in for ModemManager where there is none, in a replay */
+typedef struct {
+    /* a kick's tier starts, with its first step's call to follow */
+    void (*tier_started) (MMObject *modem_object, gpointer user_data);
+    /* the op state's call; answered later, never from within, with
+     * modem_op_state_answered()
+     */
+    void (*call) (MMObject *modem_object, gpointer user_data);
+} FakeModemManager;
+
+typedef struct {
+    GDBusConnection *connection;
+    GMainLoop       *loop;
+    GCancellable    *cancellable;
+    /* an MMManager, or a plain client in minimal-proxies mode */
+    GDBusObjectManager *mm;
+    Scheduler       *scheduler;
+    Config           config;
+    /* monotonic time the daemon started */
+    gint64           started;
+
+    /* settings given on the command line win over the config file */
+    gchar *config_path;
+    gint   threshold_overrides[N_KICK_THRESHOLDS];  /* -1 if not given */
+
+    /* path -> MMObject of every modem being watched */
+    GHashTable *modems;
+    /* equipment identifier (or path) -> ModemContext, attached or not */
+    GHashTable *devices;
+    /* modems reported by ModemManager but not looked at yet, attached one
+     * per main loop iteration by attach_id
+     */
+    GQueue      attach_queue;
+    guint       attach_id;
+    /* the manager was created while ModemManager was not on the bus */
+    gboolean    mm_missed_owner;
+
+    /* manufacturer and model -> ModelStats */
+    GHashTable *model_stats;
+
+    /* modems whose next op state has to wait for a free slot, oldest first */
+    GQueue slot_queue;
+    guint  calls_running;
+    /* gets the op states' calls instead of ModemManager if set */
+    const FakeModemManager *fake_mm;
+    gpointer                fake_mm_data;
+
+    /* kicks that may start, refilled at the KickRate property if set (-1:
+     * not), else at config.kick_rate
+     */
+    TokenBucket kick_tokens;
+    gdouble     kick_rate;
+
+    Metrics        *metrics;
+    /* listening on metrics_socket, if set */
+    GSocketService *metrics_service;
+    gchar          *metrics_socket;
+    guint           metrics_clients;  /* connections being served */
+
+    /* contents of config.state_file, written out by state_timer */
+    GKeyFile *state;
+    Timer     state_timer;
+
+    /* PowerJobs waiting to switch a modem back on */
+    GPtrArray *power_jobs;
+
+    /* the org.jucr.ModemKick service on ctx->connection */
+    guint service_name_id;
+    guint service_object_id;
+
+    guint name_owner_changed_id;
+    guint object_added_id;
+    guint object_removed_id;
+} Context;
+
+static Metrics *metrics_new (void);
+static void     metrics_free (Metrics *metrics);
+static void     context_update_metrics_socket (Context *ctx);
+static void     modem_context_free (ModemContext *modem_ctx);
+static void     modem_object_detach (MMObject *modem_object);
+static void     context_export (Context *ctx);
+static void     context_unexport (Context *ctx);
+static void     context_restore_power (Context *ctx);
+
+/*****************************************************************************/
+/* State file
+ *
+ * Keeps the failure clock and recovery ladder of failing modems across
+ * daemon and ModemManager restarts, so that a modem that has been failing
+ * for a while doesn't start over. Modems are keyed by equipment identifier
+ * (IMEI) as their D-Bus paths change on every restart, and times are stored
+ * as wall-clock seconds, to be mapped back onto the monotonic clock when the
+ * modem reappears. A reboot resets every modem anyway, so state written
+ * during an earlier boot is dropped.
+ */
+
+#define STATE_GROUP               "state"
+#define STATE_WRITE_DELAY_SECONDS 1
+
+static gchar *
+get_boot_id (void)
+{
+    gchar *boot_id = NULL;
+
+    if (!g_file_get_contents ("/proc/sys/kernel/random/boot_id", &boot_id, NULL, NULL))
+        return NULL;
+    return g_strstrip (boot_id);
+}
+
+static gchar *
+state_group_for_modem (const gchar *equipment_id)
+{
+    return g_strdup_printf ("modem %s", equipment_id);
+}
+
+static void
+context_write_state (Context *ctx)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!ctx->config.state_file || !*ctx->config.state_file)
+        return;
+    if (!g_key_file_save_to_file (ctx->state, ctx->config.state_file, &error))
+        g_warning ("Error: failed to write %s: %s", ctx->config.state_file, error->message);
+}
+
+/* Writes the state out shortly, batching changes to several modems */
+static void
+context_schedule_state_write (Context *ctx)
+{
+    if (!timer_is_armed (&ctx->state_timer))
+        scheduler_arm (ctx->scheduler, &ctx->state_timer,
+                       get_monotonic_time () + (gint64) STATE_WRITE_DELAY_SECONDS * G_USEC_PER_SEC);
+}
+
+/* Reads config.state_file, unless it was written during an earlier boot */
+static void
+context_load_state (Context *ctx)
+{
+    const gchar       *path = ctx->config.state_file;
+    g_autoptr(GError)  error = NULL;
+    g_autofree gchar  *boot_id = NULL;
+    g_autofree gchar  *saved_boot_id = NULL;
+
+    boot_id = get_boot_id ();
+    if (path && *path && !g_key_file_load_from_file (ctx->state, path, G_KEY_FILE_NONE, &error)) {
+        if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_warning ("Error: failed to read %s: %s", path, error->message);
+    }
+
+    saved_boot_id = g_key_file_get_string (ctx->state, STATE_GROUP, "boot-id", NULL);
+    if (g_strcmp0 (boot_id, saved_boot_id) != 0) {
+        if (saved_boot_id)
+            g_message ("%s: written before last boot; ignoring", path);
+        g_key_file_unref (ctx->state);
+        ctx->state = g_key_file_new ();
+    }
+    if (boot_id)
+        g_key_file_set_string (ctx->state, STATE_GROUP, "boot-id", boot_id);
+}
+
+/* Sets @group/@key to @seconds unless it is already within a second of it,
+ * which is how far apart two mappings of the same monotonic time may be.
+ */
+static gboolean
+state_set_seconds (GKeyFile *state, const gchar *group, const gchar *key, gint64 seconds)
+{
+    g_autoptr(GError) error = NULL;
+    gint64            old;
+
+    old = g_key_file_get_int64 (state, group, key, &error);
+    if (!error && ABS (old - seconds) <= 1)
+        return FALSE;
+    g_key_file_set_int64 (state, group, key, seconds);
+    return TRUE;
+}
+
+/* Maps a monotonic time to wall-clock seconds; 0 stays 0 */
+static gint64
+monotonic_to_real_seconds (gint64 monotonic)
+{
+    if (!monotonic)
+        return 0;
+    return (g_get_real_time () - (get_monotonic_time () - monotonic)) / G_USEC_PER_SEC;
+}
+
+/*****************************************************************************/
+
+static Context *
+context_new (void)
+{
+    Context *ctx;
+    guint    i;
+
+    ctx = g_slice_new0 (Context);
+    ctx->loop = g_main_loop_new (NULL, FALSE);
+    ctx->cancellable = g_cancellable_new ();
+    ctx->scheduler = scheduler_new ();
+    ctx->started = get_monotonic_time ();
+    config_init (&ctx->config);
+    ctx->config_path = g_strdup (CONFIG_FILE);
+    for (i = 0; i < N_KICK_THRESHOLDS; i++)
+        ctx->threshold_overrides[i] = -1;
+    ctx->modems = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) modem_object_detach);
+    ctx->devices = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) modem_context_free);
+    ctx->model_stats = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    ctx->power_jobs = g_ptr_array_new ();
+    ctx->kick_rate = -1;
+    g_queue_init (&ctx->slot_queue);
+    g_queue_init (&ctx->attach_queue);
+    ctx->metrics = metrics_new ();
+    ctx->state = g_key_file_new ();
+    timer_init (&ctx->state_timer, (TimerFunc) context_write_state, ctx);
+    return ctx;
+}
+
+static void
+context_clear_modems (Context *ctx)
+{
+    g_message ("clearing modems");
+    g_clear_handle_id (&ctx->attach_id, g_source_remove);
+    g_queue_clear_full (&ctx->attach_queue, g_object_unref);
+    g_hash_table_remove_all (ctx->modems);
+}
+
+static void
+context_clear_manager (Context *ctx)
+{
+    if (ctx->name_owner_changed_id) {
+        g_signal_handler_disconnect (ctx->mm, ctx->name_owner_changed_id);
+        ctx->name_owner_changed_id = 0;
+    }
+    if (ctx->object_added_id) {
+        g_signal_handler_disconnect (ctx->mm, ctx->object_added_id);
+        ctx->object_added_id = 0;
+    }
+    if (ctx->object_removed_id) {
+        g_signal_handler_disconnect (ctx->mm, ctx->object_removed_id);
+        ctx->object_removed_id = 0;
+    }
+
+    g_clear_object (&ctx->mm);
+
+    context_clear_modems (ctx);
+}
+
+static void
+context_free (Context *ctx)
+{
+    /* don't lose changes still waiting to be written */
+    if (timer_is_armed (&ctx->state_timer)) {
+        scheduler_cancel (ctx->scheduler, &ctx->state_timer);
+        context_write_state (ctx);
+    }
+
+    context_unexport (ctx);
+    context_clear_manager (ctx);
+
+    g_hash_table_destroy (ctx->modems);
+    g_hash_table_destroy (ctx->devices);
+    g_hash_table_destroy (ctx->model_stats);
+    /* never leave a modem switched off behind */
+    context_restore_power (ctx);
+    g_ptr_array_unref (ctx->power_jobs);
+    /* without a configured socket, this closes the metrics endpoint */
+    config_clear (&ctx->config);
+    context_update_metrics_socket (ctx);
+    metrics_free (ctx->metrics);
+    g_key_file_unref (ctx->state);
+    scheduler_free (ctx->scheduler);
+    g_cancellable_cancel (ctx->cancellable);
+    g_clear_object (&ctx->cancellable);
+    g_clear_object (&ctx->connection);
+    g_free (ctx->config_path);
+    g_main_loop_unref (ctx->loop);
+    g_slice_free (Context, ctx);
+}
+
+/*****************************************************************************/
+
+static void modem_registration_changed (GObject *source_object, GParamSpec *pspec, MMObject *modem_object);
+static void modem_update_kick_deadline (ModemContext *modem_ctx);
+static gint64 modem_context_get_kick_deadline (ModemContext *modem_ctx, gint64 now);
+static void modem_state_changed (MMModem *modem, GParamSpec *pspec, MMObject *modem_object);
+static void modem_signal_quality_changed (MMModem *modem, GParamSpec *pspec, MMObject *modem_object);
+
+/*****************************************************************************/
+/* Metrics
+ *
+ * Counters and latency histograms of everything the kick machinery does,
+ * served in Prometheus text format (see context_update_metrics_socket).
+ */
+
+/* upper bucket bounds, in seconds */
+static const gdouble histogram_bounds[] = {
+    0.1, 0.5, 1, 5, 10, 30, 60, 120, 300, 600, 1800, 3600,
+};
+
+#define N_HISTOGRAM_BOUNDS G_N_ELEMENTS (histogram_bounds)
+
+typedef struct {
+    guint64 buckets[N_HISTOGRAM_BOUNDS];  /* per bucket, not cumulative */
+    guint64 count;
+    gdouble sum;                          /* seconds */
+} Histogram;
+
+struct Metrics {
+    guint64   registration_changes;
+    /* failure clock start to first kick */
+    Histogram detect;
+    /* every tier a kick runs, including those it escalates to */
+    guint64   kicks[N_KICK_TIERS];
+    guint64   escalations;
+    guint64   rate_limited;
+    guint64   data_stalls;
+    /* op state issued to ModemManager reporting it done */
+    Histogram steps[N_OP_STATES];
+    guint64   step_failures[N_OP_STATES];
+    guint64   step_timeouts[N_OP_STATES];  /* included in step_failures */
+    guint64   step_retries;
+    /* last kick to registration, by the tier of that kick */
+    Histogram recovery[N_KICK_TIERS];
+    guint64   kick_successes[N_KICK_TIERS];
+    guint64   kick_failures[N_KICK_TIERS];
+};
+
+static Metrics *
+metrics_new (void)
+{
+    return g_slice_new0 (Metrics);
+}
+
+static void
+metrics_free (Metrics *metrics)
+{
+    g_slice_free (Metrics, metrics);
+}
+
+static void
+histogram_observe (Histogram *histogram, gint64 usec)
+{
+    gdouble seconds = (gdouble) usec / G_USEC_PER_SEC;
+    guint   i;
+
+    for (i = 0; i < N_HISTOGRAM_BOUNDS; i++) {
+        if (seconds <= histogram_bounds[i]) {
+            histogram->buckets[i]++;
+            break;
+        }
+    }
+    histogram->count++;
+    histogram->sum += seconds;
+}
+
+/* @labels: "key=\"value\"" pairs without braces, or NULL */
+static void
+histogram_print (GString *out, const gchar *name, const gchar *labels, const Histogram *histogram)
+{
+    const gchar *sep = labels ? "," : "";
+    guint64      cumulative = 0;
+    guint        i;
+
+    if (!labels)
+        labels = "";
+    for (i = 0; i < N_HISTOGRAM_BOUNDS; i++) {
+        cumulative += histogram->buckets[i];
+        g_string_append_printf (out, "%s_bucket{%s%sle=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                                name, labels, sep, histogram_bounds[i], cumulative);
+    }
+    g_string_append_printf (out, "%s_bucket{%s%sle=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                            name, labels, sep, histogram->count);
+    if (*labels) {
+        g_string_append_printf (out, "%s_sum{%s} %.17g\n", name, labels, histogram->sum);
+        g_string_append_printf (out, "%s_count{%s} %" G_GUINT64_FORMAT "\n", name, labels, histogram->count);
+    } else {
+        g_string_append_printf (out, "%s_sum %.17g\n", name, histogram->sum);
+        g_string_append_printf (out, "%s_count %" G_GUINT64_FORMAT "\n", name, histogram->count);
+    }
+}
+
+static void
+metrics_print_header (GString *out, const gchar *name, const gchar *type, const gchar *help)
+{
+    g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static gchar *
+metrics_render (Context *ctx)
+{
+    const Metrics *metrics = ctx->metrics;
+    GString       *out = g_string_new (NULL);
+    guint          i;
+
+    metrics_print_header (out, "modem_kick_modems", "gauge", "Modems being watched");
+    g_string_append_printf (out, "modem_kick_modems %u\n", g_hash_table_size (ctx->modems));
+    metrics_print_header (out, "modem_kick_calls_running", "gauge", "ModemManager calls for kicks in flight");
+    g_string_append_printf (out, "modem_kick_calls_running %u\n", ctx->calls_running);
+    metrics_print_header (out, "modem_kick_calls_queued", "gauge", "Kick steps waiting for a free slot");
+    g_string_append_printf (out, "modem_kick_calls_queued %u\n", g_queue_get_length (&ctx->slot_queue));
+    metrics_print_header (out, "modem_kick_timer_wakeups_total", "counter", "Times the daemon's timers woke it up");
+    g_string_append_printf (out, "modem_kick_timer_wakeups_total %" G_GUINT64_FORMAT "\n", ctx->scheduler->wakeups);
+
+    metrics_print_header (out, "modem_kick_registration_changes_total", "counter",
+                          "Registration state changes reported by ModemManager");
+    g_string_append_printf (out, "modem_kick_registration_changes_total %" G_GUINT64_FORMAT "\n",
+                            metrics->registration_changes);
+
+    metrics_print_header (out, "modem_kick_detect_seconds", "histogram",
+                          "Time from losing registration to the first kick");
+    histogram_print (out, "modem_kick_detect_seconds", NULL, &metrics->detect);
+
+    metrics_print_header (out, "modem_kick_kicks_total", "counter", "Kicks started or escalated to, by recovery tier");
+    for (i = 0; i < N_KICK_TIERS; i++)
+        g_string_append_printf (out, "modem_kick_kicks_total{tier=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                                kick_tiers[i].name, metrics->kicks[i]);
+    metrics_print_header (out, "modem_kick_kick_results_total", "counter",
+                          "Kicks that did or didn't bring registration back within the verify window");
+    for (i = 0; i < N_KICK_TIERS; i++) {
+        g_string_append_printf (out, "modem_kick_kick_results_total{tier=\"%s\",result=\"recovered\"} %" G_GUINT64_FORMAT "\n",
+                                kick_tiers[i].name, metrics->kick_successes[i]);
+        g_string_append_printf (out, "modem_kick_kick_results_total{tier=\"%s\",result=\"failed\"} %" G_GUINT64_FORMAT "\n",
+                                kick_tiers[i].name, metrics->kick_failures[i]);
+    }
+    metrics_print_header (out, "modem_kick_escalations_total", "counter",
+                          "Times a kick moved on to a more expensive recovery tier");
+    g_string_append_printf (out, "modem_kick_escalations_total %" G_GUINT64_FORMAT "\n", metrics->escalations);
+    metrics_print_header (out, "modem_kick_rate_limited_total", "counter",
+                          "Times a due kick had to wait for the kick rate limit");
+    g_string_append_printf (out, "modem_kick_rate_limited_total %" G_GUINT64_FORMAT "\n", metrics->rate_limited);
+    metrics_print_header (out, "modem_kick_data_stalls_total", "counter",
+                          "Times a registered modem's data path was found dead");
+    g_string_append_printf (out, "modem_kick_data_stalls_total %" G_GUINT64_FORMAT "\n", metrics->data_stalls);
+
+    metrics_print_header (out, "modem_kick_step_seconds", "histogram",
+                          "Time ModemManager took to complete a kick step");
+    for (i = 0; i < N_OP_STATES; i++) {
+        g_autofree gchar *labels = NULL;
+
+        if (!op_state_names[i])
+            continue;
+        labels = g_strdup_printf ("step=\"%s\"", op_state_names[i]);
+        histogram_print (out, "modem_kick_step_seconds", labels, &metrics->steps[i]);
+    }
+    metrics_print_header (out, "modem_kick_step_failures_total", "counter", "Kick steps that failed");
+    for (i = 0; i < N_OP_STATES; i++) {
+        if (op_state_names[i])
+            g_string_append_printf (out, "modem_kick_step_failures_total{step=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                                    op_state_names[i], metrics->step_failures[i]);
+    }
+    metrics_print_header (out, "modem_kick_step_timeouts_total", "counter", "Kick steps ModemManager didn't answer in time");
+    for (i = 0; i < N_OP_STATES; i++) {
+        if (op_state_names[i])
+            g_string_append_printf (out, "modem_kick_step_timeouts_total{step=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                                    op_state_names[i], metrics->step_timeouts[i]);
+    }
+    metrics_print_header (out, "modem_kick_step_retries_total", "counter", "Kick steps retried after failing");
+    g_string_append_printf (out, "modem_kick_step_retries_total %" G_GUINT64_FORMAT "\n", metrics->step_retries);
+
+    metrics_print_header (out, "modem_kick_recovery_seconds", "histogram",
+                          "Time from the last kick to registration, by the tier of that kick");
+    for (i = 0; i < N_KICK_TIERS; i++) {
+        g_autofree gchar *labels = NULL;
+
+        labels = g_strdup_printf ("tier=\"%s\"", kick_tiers[i].name);
+        histogram_print (out, "modem_kick_recovery_seconds", labels, &metrics->recovery[i]);
+    }
+
+    return g_string_free (out, FALSE);
+}
+
+/*****************************************************************************/
+/* Registration sources
+ *
+ * The deadline engine and the recovery ladder deal in 3GPP registration
+ * states. 3GPP modems report those directly; for other modems a source maps
+ * what they do report onto them, so the same thresholds apply: "idle" for a
+ * modem that is enabled but neither registered nor searching.
+ */
+
+#define N_SOURCE_SIGNALS 2
+
+typedef struct {
+    const gchar *name;
+    /* the object whose properties tell the registration state, or NULL if
+     * the modem doesn't have it
+     */
+    gpointer     (*peek) (MMObject *modem_object);
+    const gchar  *signals[N_SOURCE_SIGNALS];  /* on that object; NULL-terminated if fewer */
+    gboolean      modem_state;   /* also follows the Modem's state */
+    MMModem3gppRegistrationState (*get_state) (gpointer object, MMModem *modem);
+} RegistrationSource;
+
+static gpointer
+source_3gpp_peek (MMObject *modem_object)
+{
+    return mm_object_peek_modem_3gpp (modem_object);
+}
+
+static MMModem3gppRegistrationState
+source_3gpp_get_state (gpointer object, MMModem *modem)
+{
+    return mm_modem_3gpp_get_registration_state (object);
+}
+
+static MMModem3gppRegistrationState
+modem_state_to_registration (MMModemState state)
+{
+    switch (state) {
+    case MM_MODEM_STATE_REGISTERED:
+    case MM_MODEM_STATE_DISCONNECTING:
+    case MM_MODEM_STATE_CONNECTING:
+    case MM_MODEM_STATE_CONNECTED:
+        return MM_MODEM_3GPP_REGISTRATION_STATE_HOME;
+    case MM_MODEM_STATE_SEARCHING:
+        return MM_MODEM_3GPP_REGISTRATION_STATE_SEARCHING;
+    case MM_MODEM_STATE_ENABLED:
+        return MM_MODEM_3GPP_REGISTRATION_STATE_IDLE;
+    default:
+        /* disabled, locked, failed, or on the way there or back */
+        return MM_MODEM_3GPP_REGISTRATION_STATE_UNKNOWN;
+    }
+}
+
+static gpointer
+source_cdma_peek (MMObject *modem_object)
+{
+    return mm_object_peek_modem_cdma (modem_object);
+}
+
+/* Registered if either 1x or EV-DO is; otherwise the Modem's state tells
+ * searching from idle
+ */
+static MMModem3gppRegistrationState
+source_cdma_get_state (gpointer object, MMModem *modem)
+{
+    MMModemCdmaRegistrationState states[2];
+    gboolean                     registered = FALSE;
+    guint                        i;
+
+    states[0] = mm_modem_cdma_get_cdma1x_registration_state (object);
+    states[1] = mm_modem_cdma_get_evdo_registration_state (object);
+    for (i = 0; i < G_N_ELEMENTS (states); i++) {
+        if (states[i] == MM_MODEM_CDMA_REGISTRATION_STATE_ROAMING)
+            return MM_MODEM_3GPP_REGISTRATION_STATE_ROAMING;
+        if (states[i] != MM_MODEM_CDMA_REGISTRATION_STATE_UNKNOWN)
+            registered = TRUE;
+    }
+    if (registered)
+        return MM_MODEM_3GPP_REGISTRATION_STATE_HOME;
+    return modem_state_to_registration (mm_modem_get_state (modem));
+}
+
+static gpointer
+source_generic_peek (MMObject *modem_object)
+{
+    return mm_object_peek_modem (modem_object);
+}
+
+static MMModem3gppRegistrationState
+source_generic_get_state (gpointer object, MMModem *modem)
+{
+    return modem_state_to_registration (mm_modem_get_state (modem));
+}
+
+/* In order of preference; the generic one fits any modem */
+static const RegistrationSource registration_sources[] = {
+    { "3gpp",    source_3gpp_peek,    { "notify::registration-state", NULL }, FALSE, source_3gpp_get_state },
+    { "cdma",    source_cdma_peek,    { "notify::cdma1x-registration-state", "notify::evdo-registration-state" },
+      TRUE, source_cdma_get_state },
+    { "generic", source_generic_peek, { NULL }, TRUE, source_generic_get_state },
+};
+
+/*****************************************************************************/
+
+/* registration state changes kept per modem for flapping detection */
+#define HISTORY_SIZE 64
+
+typedef struct {
+    gint64                       time;  /* monotonic; when the state was entered */
+    MMModem3gppRegistrationState state;
+} HistoryEntry;
+
+/* One per device, in ctx->devices. ModemManager gives a modem a new D-Bus
+ * object (and path) whenever it re-probes it; the device's ModemContext
+ * outlives that and is attached to each object in turn, so kick history
+ * and the failure clock carry over.
+ */
+struct ModemContext {
+    Context     *ctx;
+    /* IMEI; NULL if ModemManager doesn't know it, in which case the context
+     * is keyed by path and dropped along with its object
+     */
+    gchar       *equipment_id;
+
+    /* The attached object, or NULL; the rest of this block and the op state
+     * are only valid while attached
+     */
+    MMObject    *object;
+    const gchar *path;    /* object's path; equipment_id while detached */
+    MMModem     *modem;
+    MMModem3gpp *modem_3gpp;  /* NULL unless the modem speaks 3GPP */
+    /* where the registration state comes from, and the object it's read from */
+    const RegistrationSource *source;
+    gpointer                  source_object;
+
+    gulong reg_state_changed_ids[N_SOURCE_SIGNALS];
+    guint state_changed_id;
+    guint power_state_changed_id;
+    guint signal_quality_changed_id;
+
+    /* monotonic timestamp when modem entered a registration state that has a
+     * kick threshold; set to 0 when modem enters any other state.
+     */
+    gint64 timestamp;
+    /* threshold (seconds) of the last such state the modem was in */
+    guint  threshold;
+    /* this device's share of config.stagger (usec), added to threshold */
+    gint64 stagger;
+    /* TRUE while ModemManager reports a recent signal quality of 0 */
+    gboolean no_signal;
+    /* why the network last refused registration, until the modem registers;
+     * kicks then only re-register, and for a permanent cause only every
+     * config.reject_holdoff
+     */
+    const RejectCause *reject;
+    /* ring buffer of the last HISTORY_SIZE registration states; once full
+     * the oldest entry is overwritten
+     */
+    HistoryEntry history[HISTORY_SIZE];
+    guint        history_len;
+    guint        history_next;  /* index the next entry goes to */
+    /* time in idle/denied before this (the last kick) doesn't count towards
+     * flapping detection
+     */
+    gint64       unusable_since;
+    /* fires when the modem has been idle/denied for longer than threshold;
+     * only armed while timestamp is set.
+     */
+    Timer  kick_timer;
+    /* no new kick starts before this monotonic time; pushed out by
+     * kick_backoff after each kick that didn't bring registration back.
+     */
+    gint64  kick_holdoff;
+    Backoff kick_backoff;
+    /* registration gets until this monotonic time to recover from the last
+     * kick; until then only a successful registration clears timestamp.
+     */
+    gint64  kick_verify_until;
+    /* recovery tier the next kick will use */
+    KickTier next_tier;
+    /* monotonic time the last kick started; 0 if none since registration */
+    gint64   kick_started;
+    /* TRUE from the start of a kick until registration comes back or
+     * verify_timer fires at kick_verify_until, deciding how it went
+     */
+    gboolean kick_unverified;
+    Timer    verify_timer;
+    /* "manufacturer model", for ctx->model_stats; NULL while unknown */
+    gchar   *model;
+    /* settings from the global config and the modem's profile, if any */
+    gchar   *profile;
+    gint     thresholds[N_KICK_THRESHOLDS];
+    gint     step_delay;
+    guint    tiers;  /* bit per KickTier; never 0 */
+    /* whether this modem's op state call holds one of the ctx->calls_running
+     * slots, or waits for one in ctx->slot_queue
+     */
+    gboolean has_slot;
+    gboolean slot_queued;
+    /* the pre-kick hook while it runs, until hook_timer gives up on it;
+     * hook_approved once it let the due kick go ahead
+     */
+    GSubprocess  *hook;
+    GCancellable *hook_cancellable;
+    Timer         hook_timer;
+    gboolean      hook_approved;
+    /* an operator asked for a kick right away (KickNow) */
+    gboolean      kick_forced;
+    /* data path probing while registered: probe_timer starts the next probe
+     * and probe_timeout gives up on probe_command; probe_cancellable is set
+     * while one runs. probe_iface and its byte counters are from the last
+     * probe that found a connected bearer. data_stalled makes registration
+     * count as idle until a probe sees data again or a kick finishes.
+     */
+    Timer         probe_timer;
+    Timer         probe_timeout;
+    Backoff       probe_backoff;
+    GCancellable *probe_cancellable;
+    GSubprocess  *probe;
+    gchar        *probe_iface;
+    guint64       rx_bytes;
+    guint64       tx_bytes;
+    gboolean      data_stalled;
+    /* messages logged since log_window_start, and those dropped once
+     * config.log_burst was reached
+     */
+    gint64 log_window_start;
+    guint  log_count;
+    guint  log_suppressed;
+
+    /* Created & used each time modem needs a kick */
+    GCancellable *cancellable;
+
+    KickTier tier;
+    guint    step;     /* index into kick_tiers[tier].steps */
+    OpState  op_state;
+    Timer    op_timer;
+    guint    tries;
+    Backoff  retry_backoff;
+    /* monotonic time op_state was issued to ModemManager; step_timer gives
+     * up on the call modem_context_get_step_timeout() seconds later
+     */
+    gint64   op_started;
+    Timer    step_timer;
+    /* TRUE while the pending op state may run as soon as ModemManager reports
+     * that the previous one took effect, instead of waiting for op_timer.
+     */
+    gboolean op_early;
+};
+
+static ModemContext *
+get_modem_context (MMObject *obj)
+{
+    return g_object_get_data (G_OBJECT (obj), "modem-context");
+}
+
+static void modem_kick_cb (MMObject *modem_object);
+static void modem_op_state_run (MMObject *modem_object);
+static void context_admit_steps (Context *ctx);
+static void modem_verify_cb (ModemContext *modem_ctx);
+static void modem_hook_timeout_cb (ModemContext *modem_ctx);
+static void modem_step_timeout_cb (ModemContext *modem_ctx);
+static void modem_probe_cb (ModemContext *modem_ctx);
+static void modem_probe_timeout_cb (ModemContext *modem_ctx);
+static void modem_update_registration (MMObject *modem_object);
+static void modem_context_store_state (ModemContext *modem_ctx);
+static void modem_context_finish_kick (ModemContext *modem_ctx);
+
+/* Logging: per-modem messages carry the modem's state as journal fields */
+
+static void
+modem_log_write (ModemContext *modem_ctx, GLogLevelFlags level, const gchar *message)
+{
+    g_autofree gchar *text = NULL;
+    g_autofree gchar *tries = NULL;
+    /* not attached yet, and no IMEI to go by */
+    const gchar      *path = modem_ctx->path ? modem_ctx->path : "unknown";
+    const gchar      *reg_state = "unknown";
+    const gchar      *op_state;
+    GLogField         fields[7];
+    gsize             n = 0;
+
+    if (modem_ctx->history_len) {
+        const HistoryEntry *last = &modem_ctx->history[(modem_ctx->history_next + HISTORY_SIZE - 1) % HISTORY_SIZE];
+
+        reg_state = mm_modem_3gpp_registration_state_get_string (last->state);
+    }
+    op_state = op_state_names[modem_ctx->op_state];
+    if (!op_state)
+        op_state = modem_ctx->op_state == MODEM_OP_STATE_NONE ? "none" : "finish";
+    /* keep the usual look in plain text logs */
+    text = g_strdup_printf (level == G_LOG_LEVEL_WARNING ? "Error: %s: %s" : "%s: %s", path, message);
+    tries = g_strdup_printf ("%u", modem_ctx->tries);
+
+    /* as g_log_structured() would, for the journal's benefit */
+    fields[n++] = (GLogField) { "PRIORITY", level & G_LOG_LEVEL_WARNING ? "4" : "5", -1 };
+    fields[n++] = (GLogField) { "MESSAGE", text, -1 };
+    fields[n++] = (GLogField) { "MODEM_PATH", path, -1 };
+    if (modem_ctx->equipment_id)
+        fields[n++] = (GLogField) { "MODEM_ID", modem_ctx->equipment_id, -1 };
+    fields[n++] = (GLogField) { "REG_STATE", reg_state, -1 };
+    fields[n++] = (GLogField) { "OP_STATE", op_state, -1 };
+    fields[n++] = (GLogField) { "TRIES", tries, -1 };
+    g_log_structured_array (level, fields, n);
+}
+
+static void modem_log (ModemContext *modem_ctx, GLogLevelFlags level, const gchar *format, ...) G_GNUC_PRINTF (3, 4);
+
+static void
+modem_log (ModemContext *modem_ctx, GLogLevelFlags level, const gchar *format, ...)
+{
+    const Config     *config = &modem_ctx->ctx->config;
+    g_autofree gchar *message = NULL;
+    va_list           args;
+
+    if (level == G_LOG_LEVEL_MESSAGE && config->log_burst > 0) {
+        gint64 now = get_monotonic_time ();
+
+        if (now - modem_ctx->log_window_start >= (gint64) config->log_interval * G_USEC_PER_SEC) {
+            if (modem_ctx->log_suppressed) {
+                g_autofree gchar *note = NULL;
+
+                note = g_strdup_printf ("%u messages suppressed", modem_ctx->log_suppressed);
+                modem_log_write (modem_ctx, level, note);
+            }
+            modem_ctx->log_window_start = now;
+            modem_ctx->log_count = 0;
+            modem_ctx->log_suppressed = 0;
+        }
+        if (modem_ctx->log_count >= (guint) config->log_burst) {
+            modem_ctx->log_suppressed++;
+            return;
+        }
+        modem_ctx->log_count++;
+    }
+
+    va_start (args, format);
+    message = g_strdup_vprintf (format, args);
+    va_end (args);
+    modem_log_write (modem_ctx, level, message);
+}
+
+#define modem_message(modem_ctx, ...) modem_log ((modem_ctx), G_LOG_LEVEL_MESSAGE, __VA_ARGS__)
+#define modem_warning(modem_ctx, ...) modem_log ((modem_ctx), G_LOG_LEVEL_WARNING, __VA_ARGS__)
+
+/* Applies the current Config, and the profile matching the modem if it's
+ * attached, to the modem's settings and backoff policies
+ */
+static void
+modem_context_configure (ModemContext *modem_ctx)
+{
+    const Config  *config = &modem_ctx->ctx->config;
+    const Profile *profile = NULL;
+    gint           retry_max;
+    guint          available;
+    guint          i;
+
+    if (modem_ctx->modem)
+        profile = config_match_profile (config,
+                                        mm_modem_get_manufacturer (modem_ctx->modem),
+                                        mm_modem_get_model (modem_ctx->modem),
+                                        mm_modem_get_revision (modem_ctx->modem));
+    if (profile && g_strcmp0 (profile->name, modem_ctx->profile) != 0)
+        modem_message (modem_ctx, "using profile %s", profile->name);
+    g_free (modem_ctx->profile);
+    modem_ctx->profile = profile ? g_strdup (profile->name) : NULL;
+
+    for (i = 0; i < N_KICK_THRESHOLDS; i++)
+        modem_ctx->thresholds[i] = profile && profile->thresholds[i] >= 0 ? profile->thresholds[i] : config->thresholds[i];
+    modem_ctx->step_delay = profile && profile->step_delay >= 0 ? profile->step_delay : config->step_delay;
+    retry_max = profile && profile->retry_max >= 0 ? profile->retry_max : config->retry_max;
+    available = (1u << N_KICK_TIERS) - 1;
+    if (!config->power_backend[0])
+        available &= ~(1u << KICK_TIER_HARDWARE);
+    /* re-registering is a 3GPP call */
+    if (modem_ctx->modem && !modem_ctx->modem_3gpp)
+        available &= ~(1u << KICK_TIER_REGISTER);
+    modem_ctx->tiers = profile && profile->tiers ? profile->tiers & available : available;
+    if (!modem_ctx->tiers)
+        modem_ctx->tiers = available;
+
+    /* the same for a device every time, so a fleet spreads out evenly; the
+     * replay's modem has no equipment identifier
+     */
+    modem_ctx->stagger = modem_ctx->equipment_id ?
+        (gint64) (g_str_hash (modem_ctx->equipment_id) % ((guint) config->stagger * 1000 + 1)) * 1000 : 0;
+
+    backoff_configure (&modem_ctx->kick_backoff, config->repeat, config->repeat_max, config->multiplier, config->jitter);
+    backoff_configure (&modem_ctx->retry_backoff, modem_ctx->step_delay, retry_max, config->multiplier, config->jitter);
+    backoff_configure (&modem_ctx->probe_backoff, config->probe_interval, config->probe_max_interval,
+                       config->multiplier, config->jitter);
+}
+
+static guint
+modem_context_get_threshold (ModemContext *modem_ctx, MMModem3gppRegistrationState reg_state)
+{
+    return thresholds_get (modem_ctx->thresholds, reg_state);
+}
+
+/* Returns the first tier from @tier on that the modem's profile allows, or
+ * its last one
+ */
+static KickTier
+modem_context_tier_from (ModemContext *modem_ctx, gint tier)
+{
+    gint last = KICK_TIER_LAST;
+
+    /* the network refusing the subscription isn't the modem's fault */
+    if (modem_ctx->reject && (modem_ctx->tiers & (1u << KICK_TIER_REGISTER)))
+        last = KICK_TIER_REGISTER;
+    while (!(modem_ctx->tiers & (1u << last)))
+        last--;
+    for (; tier < last; tier++) {
+        if (modem_ctx->tiers & (1u << tier))
+            break;
+    }
+    return MIN (tier, last);
+}
+
+static KickTier
+modem_context_first_tier (ModemContext *modem_ctx)
+{
+    return modem_context_tier_from (modem_ctx, KICK_TIER_REGISTER);
+}
+
+static gboolean
+modem_context_is_last_tier (ModemContext *modem_ctx, KickTier tier)
+{
+    return modem_context_tier_from (modem_ctx, tier + 1) <= tier;
+}
+
+static ModemContext *
+modem_context_new (Context *ctx, const gchar *equipment_id)
+{
+    ModemContext *modem_ctx;
+
+    modem_ctx = g_slice_new0 (ModemContext);
+    modem_ctx->ctx = ctx;
+    modem_ctx->equipment_id = g_strdup (equipment_id);
+    modem_ctx->path = modem_ctx->equipment_id;
+    timer_init (&modem_ctx->kick_timer, (TimerFunc) modem_kick_cb, NULL);
+    timer_init (&modem_ctx->op_timer, (TimerFunc) modem_op_state_run, NULL);
+    timer_init (&modem_ctx->verify_timer, (TimerFunc) modem_verify_cb, modem_ctx);
+    timer_init (&modem_ctx->hook_timer, (TimerFunc) modem_hook_timeout_cb, modem_ctx);
+    timer_init (&modem_ctx->step_timer, (TimerFunc) modem_step_timeout_cb, modem_ctx);
+    timer_init (&modem_ctx->probe_timer, (TimerFunc) modem_probe_cb, modem_ctx);
+    timer_init (&modem_ctx->probe_timeout, (TimerFunc) modem_probe_timeout_cb, modem_ctx);
+    backoff_init (&modem_ctx->kick_backoff, 0, 0, 1.0, 0.0);
+    backoff_init (&modem_ctx->retry_backoff, 0, 0, 1.0, 0.0);
+    backoff_init (&modem_ctx->probe_backoff, 0, 0, 1.0, 0.0);
+    modem_context_configure (modem_ctx);
+
+    return modem_ctx;
+}
+
+/* Kick hook */
+
+/* Runs the hook for @event about a kick with @tier; @result, if not NULL,
+ * is passed as an extra argument. Returns NULL if there is no hook.
+ */
+static GSubprocess *
+modem_context_spawn_hook (ModemContext *modem_ctx, const gchar *event, KickTier tier, const gchar *result)
+{
+    const Config      *config = &modem_ctx->ctx->config;
+    g_autoptr(GError)  error = NULL;
+    GSubprocess       *hook;
+    const gchar       *argv[] = {
+        config->hook, event, modem_ctx->path, modem_ctx->equipment_id ? modem_ctx->equipment_id : "",
+        kick_tiers[tier].name, result, NULL
+    };
+
+    /* a replay doesn't kick anything real */
+    if (!config->hook[0] || time_is_virtual)
+        return NULL;
+
+    hook = g_subprocess_newv (argv, G_SUBPROCESS_FLAGS_NONE, &error);
+    if (!hook)
+        g_warning ("Error: couldn't run %s %s: '%s'", config->hook, event, error->message);
+    return hook;
+}
+
+static void
+modem_context_cancel_hook (ModemContext *modem_ctx)
+{
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->hook_timer);
+    if (modem_ctx->hook_cancellable) {
+        g_cancellable_cancel (modem_ctx->hook_cancellable);
+        g_clear_object (&modem_ctx->hook_cancellable);
+    }
+    if (modem_ctx->hook) {
+        g_subprocess_force_exit (modem_ctx->hook);
+        g_clear_object (&modem_ctx->hook);
+    }
+    modem_ctx->hook_approved = FALSE;
+}
+
+/* Lets the due kick go ahead, as if kick_timer had just fired */
+static void
+modem_context_hook_approve (ModemContext *modem_ctx)
+{
+    modem_context_cancel_hook (modem_ctx);
+    modem_ctx->hook_approved = TRUE;
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->kick_timer);
+    modem_kick_cb (modem_ctx->object);
+}
+
+static void
+modem_hook_timeout_cb (ModemContext *modem_ctx)
+{
+    modem_warning (modem_ctx, "pre-kick hook didn't answer within %d seconds; kicking anyway", modem_ctx->ctx->config.hook_timeout);
+    modem_context_hook_approve (modem_ctx);
+}
+
+static void
+modem_hook_ready (GSubprocess *hook, GAsyncResult *res, ModemContext *modem_ctx)
+{
+    g_autoptr(GError) error = NULL;
+    gint64            now;
+    gint64            delay;
+
+    if (!g_subprocess_wait_finish (hook, res, &error)) {
+        /* canceled along with the kick; modem_ctx may be gone already */
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            modem_warning (modem_ctx, "couldn't wait for pre-kick hook: '%s'; kicking anyway", error->message);
+            modem_context_hook_approve (modem_ctx);
+        }
+        return;
+    }
+
+    if (!g_subprocess_get_if_exited (hook)) {
+        modem_warning (modem_ctx, "pre-kick hook crashed; kicking anyway");
+        modem_context_hook_approve (modem_ctx);
+        return;
+    }
+
+    now = get_monotonic_time ();
+    switch (g_subprocess_get_exit_status (hook)) {
+    case 0:
+        modem_context_hook_approve (modem_ctx);
+        return;
+    case HOOK_EXIT_DEFER:
+        delay = (gint64) modem_ctx->ctx->config.hook_defer * G_USEC_PER_SEC;
+        modem_message (modem_ctx, "pre-kick hook deferred the kick by %" G_GINT64_FORMAT " seconds", delay / G_USEC_PER_SEC);
+        break;
+    default:
+        delay = backoff_next (&modem_ctx->kick_backoff);
+        modem_message (modem_ctx, "pre-kick hook vetoed the kick; asking again in %" G_GINT64_FORMAT " seconds",
+                       delay / G_USEC_PER_SEC);
+        break;
+    }
+    modem_context_cancel_hook (modem_ctx);
+    modem_ctx->kick_holdoff = MAX (modem_ctx->kick_holdoff, now + delay);
+    modem_context_store_state (modem_ctx);
+    modem_update_kick_deadline (modem_ctx);
+}
+
+/* Asks the hook whether the due kick may go ahead. Returns FALSE if there
+ * is nobody to ask, in which case it may.
+ */
+static gboolean
+modem_context_run_hook (ModemContext *modem_ctx)
+{
+    if (modem_ctx->hook)
+        return TRUE;
+
+    modem_ctx->hook = modem_context_spawn_hook (modem_ctx, "pre-kick",
+                                                modem_context_tier_from (modem_ctx, modem_ctx->next_tier), NULL);
+    if (!modem_ctx->hook)
+        return FALSE;
+
+    modem_message (modem_ctx, "kick due; asking pre-kick hook");
+    modem_ctx->hook_cancellable = g_cancellable_new ();
+    g_subprocess_wait_async (modem_ctx->hook,
+                             modem_ctx->hook_cancellable,
+                             (GAsyncReadyCallback) modem_hook_ready,
+                             modem_ctx);
+    scheduler_arm (modem_ctx->ctx->scheduler, &modem_ctx->hook_timer,
+                   get_monotonic_time () + (gint64) modem_ctx->ctx->config.hook_timeout * G_USEC_PER_SEC);
+    return TRUE;
+}
+
+/* Gives up the modem's slot, if it has one, to the next waiting modem */
+static void
+modem_context_release_slot (ModemContext *modem_ctx)
+{
+    if (!modem_ctx->has_slot)
+        return;
+    modem_ctx->has_slot = FALSE;
+    modem_ctx->ctx->calls_running--;
+    context_admit_steps (modem_ctx->ctx);
+}
+
+/* Takes the modem out of the slot queue, or gives up its slot */
+static void
+modem_context_drop_slot (ModemContext *modem_ctx)
+{
+    if (modem_ctx->slot_queued) {
+        g_queue_remove (&modem_ctx->ctx->slot_queue, modem_ctx->object);
+        modem_ctx->slot_queued = FALSE;
+    }
+    modem_context_release_slot (modem_ctx);
+}
+
+static void
+modem_context_cancel_op (ModemContext *modem_ctx)
+{
+    modem_ctx->op_state = MODEM_OP_STATE_NONE;
+    g_cancellable_cancel (modem_ctx->cancellable);
+    g_clear_object (&modem_ctx->cancellable);
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->op_timer);
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->step_timer);
+    modem_context_drop_slot (modem_ctx);
+    modem_ctx->tries = 0;
+}
+
+static void
+modem_context_cancel_kick (ModemContext *modem_ctx)
+{
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->kick_timer);
+    modem_context_cancel_hook (modem_ctx);
+    modem_ctx->kick_forced = FALSE;
+}
+
+/* Only called for detached contexts */
+static void
+modem_context_free (ModemContext *modem_ctx)
+{
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->verify_timer);
+    g_free (modem_ctx->model);
+    g_free (modem_ctx->profile);
+    g_free (modem_ctx->probe_iface);
+    g_free (modem_ctx->equipment_id);
+    g_slice_free (ModemContext, modem_ctx);
+}
+
+static gboolean
+reg_state_is_registered (MMModem3gppRegistrationState reg_state)
+{
+    switch (reg_state) {
+    case MM_MODEM_3GPP_REGISTRATION_STATE_HOME:
+    case MM_MODEM_3GPP_REGISTRATION_STATE_ROAMING:
+    case MM_MODEM_3GPP_REGISTRATION_STATE_HOME_SMS_ONLY:
+    case MM_MODEM_3GPP_REGISTRATION_STATE_ROAMING_SMS_ONLY:
+    case MM_MODEM_3GPP_REGISTRATION_STATE_HOME_CSFB_NOT_PREFERRED:
+    case MM_MODEM_3GPP_REGISTRATION_STATE_ROAMING_CSFB_NOT_PREFERRED:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* Records the failure clock and recovery ladder in the state file, or drops
+ * the modem from it once the clock has stopped.
+ */
+static void
+modem_context_store_state (ModemContext *modem_ctx)
+{
+    Context          *ctx = modem_ctx->ctx;
+    g_autofree gchar *group = NULL;
+    gboolean          changed;
+
+    if (!modem_ctx->equipment_id)
+        return;
+
+    group = state_group_for_modem (modem_ctx->equipment_id);
+    if (!modem_ctx->timestamp) {
+        if (g_key_file_remove_group (ctx->state, group, NULL))
+            context_schedule_state_write (ctx);
+        return;
+    }
+
+    changed = state_set_seconds (ctx->state, group, "failing-since", monotonic_to_real_seconds (modem_ctx->timestamp));
+    changed |= state_set_seconds (ctx->state, group, "holdoff-until", monotonic_to_real_seconds (modem_ctx->kick_holdoff));
+    if (!g_key_file_has_key (ctx->state, group, "next-tier", NULL) ||
+        g_key_file_get_integer (ctx->state, group, "next-tier", NULL) != (gint) modem_ctx->next_tier) {
+        g_key_file_set_integer (ctx->state, group, "next-tier", modem_ctx->next_tier);
+        changed = TRUE;
+    }
+    if (changed)
+        context_schedule_state_write (ctx);
+}
+
+/* Picks up the failure clock and recovery ladder of a modem that was
+ * failing before the restart that made it reappear.
+ */
+static void
+modem_context_restore_state (ModemContext *modem_ctx)
+{
+    Context          *ctx = modem_ctx->ctx;
+    g_autofree gchar *group = NULL;
+    gint64            now;
+    gint64            now_real;
+    gint64            failing_since;
+    gint64            holdoff_until;
+    gint              next_tier;
+
+    if (!modem_ctx->equipment_id) {
+        modem_message (modem_ctx, "no equipment identifier; failures won't survive restarts");
+        return;
+    }
+
+    group = state_group_for_modem (modem_ctx->equipment_id);
+    failing_since = g_key_file_get_int64 (ctx->state, group, "failing-since", NULL);
+    if (failing_since <= 0)
+        return;
+    holdoff_until = g_key_file_get_int64 (ctx->state, group, "holdoff-until", NULL);
+    next_tier = g_key_file_get_integer (ctx->state, group, "next-tier", NULL);
+
+    now = get_monotonic_time ();
+    now_real = g_get_real_time () / G_USEC_PER_SEC;
+    /* the wall clock may have stepped back; never start the clock in the future */
+    modem_ctx->timestamp = MAX (now - MAX (now_real - failing_since, 0) * G_USEC_PER_SEC, 1);
+    if (holdoff_until > now_real)
+        modem_ctx->kick_holdoff = now + (holdoff_until - now_real) * G_USEC_PER_SEC;
+    modem_ctx->next_tier = CLAMP (next_tier, KICK_TIER_REGISTER, KICK_TIER_LAST);
+    /* like on re-attach: ModemManager takes the modem through unknown or
+     * searching first
+     */
+    modem_ctx->kick_verify_until = now + ((gint64) ctx->config.verify * G_USEC_PER_SEC);
+
+    modem_message (modem_ctx, "failing for %" G_GINT64_FORMAT " seconds before restart; next kick: %s",
+                   (now - modem_ctx->timestamp) / G_USEC_PER_SEC,
+                   kick_tiers[modem_ctx->next_tier].name);
+}
+
+static ModelStats *
+modem_context_get_model_stats (ModemContext *modem_ctx)
+{
+    const gchar *model = modem_ctx->model ? modem_ctx->model : "unknown";
+    ModelStats  *stats;
+
+    stats = g_hash_table_lookup (modem_ctx->ctx->model_stats, model);
+    if (!stats) {
+        stats = g_new0 (ModelStats, 1);
+        g_hash_table_insert (modem_ctx->ctx->model_stats, g_strdup (model), stats);
+    }
+    return stats;
+}
+
+/* Settles how the last kick went, if that's still open */
+static void
+modem_context_verify_kick (ModemContext *modem_ctx, gboolean success)
+{
+    ModelStats *stats;
+    Metrics    *metrics = modem_ctx->ctx->metrics;
+
+    if (!modem_ctx->kick_unverified)
+        return;
+    modem_ctx->kick_unverified = FALSE;
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->verify_timer);
+
+    stats = modem_context_get_model_stats (modem_ctx);
+    if (success) {
+        stats->successes[modem_ctx->tier]++;
+        metrics->kick_successes[modem_ctx->tier]++;
+        modem_message (modem_ctx, "registration back %" G_GINT64_FORMAT " seconds after kick (%s)",
+                       (get_monotonic_time () - modem_ctx->kick_started) / G_USEC_PER_SEC,
+                       kick_tiers[modem_ctx->tier].name);
+    } else {
+        stats->failures[modem_ctx->tier]++;
+        metrics->kick_failures[modem_ctx->tier]++;
+        modem_message (modem_ctx, "kick (%s) didn't bring registration back", kick_tiers[modem_ctx->tier].name);
+    }
+}
+
+static void
+modem_verify_cb (ModemContext *modem_ctx)
+{
+    modem_context_verify_kick (modem_ctx, FALSE);
+}
+
+/* Skips the tiers from @tier on that have rarely worked on this model */
+static KickTier
+modem_context_pick_tier (ModemContext *modem_ctx, KickTier tier)
+{
+    ModelStats *stats = modem_context_get_model_stats (modem_ctx);
+
+    for (tier = modem_context_tier_from (modem_ctx, tier);
+         !modem_context_is_last_tier (modem_ctx, tier);
+         tier = modem_context_tier_from (modem_ctx, tier + 1)) {
+        guint kicks = stats->successes[tier] + stats->failures[tier];
+
+        if (kicks < LEARN_MIN_KICKS || stats->successes[tier] >= LEARN_MIN_SUCCESS * kicks)
+            break;
+        modem_message (modem_ctx, "skipping %s, which brought registration back after %u of %u kicks on %s",
+                       kick_tiers[tier].name, stats->successes[tier], kicks,
+                       modem_ctx->model ? modem_ctx->model : "this model");
+    }
+    return tier;
+}
+
+static void
+modem_context_record_state (ModemContext *modem_ctx, MMModem3gppRegistrationState reg_state)
+{
+    HistoryEntry *last;
+
+    if (modem_ctx->history_len) {
+        last = &modem_ctx->history[(modem_ctx->history_next + HISTORY_SIZE - 1) % HISTORY_SIZE];
+        if (last->state == reg_state)
+            return;
+    }
+
+    modem_ctx->history[modem_ctx->history_next].time = get_monotonic_time ();
+    modem_ctx->history[modem_ctx->history_next].state = reg_state;
+    modem_ctx->history_next = (modem_ctx->history_next + 1) % HISTORY_SIZE;
+    modem_ctx->history_len = MIN (modem_ctx->history_len + 1, HISTORY_SIZE);
+}
+
+/* Returns how long (usec) the modem spent in states with a kick threshold
+ * during the flapping window before @now, and whether it is in one now.
+ * Changes that fell out of the ring buffer count as usable time.
+ */
+static gint64
+modem_context_get_unusable_time (ModemContext *modem_ctx, gint64 now, gboolean *unusable_now)
+{
+    const Config *config = &modem_ctx->ctx->config;
+    gint64        window_start;
+    gint64        end = now;
+    gint64        total = 0;
+    guint         i;
+
+    window_start = MAX (now - (gint64) config->flap_window * G_USEC_PER_SEC, modem_ctx->unusable_since);
+    *unusable_now = FALSE;
+    for (i = 1; i <= modem_ctx->history_len && end > window_start; i++) {
+        const HistoryEntry *entry = &modem_ctx->history[(modem_ctx->history_next + HISTORY_SIZE - i) % HISTORY_SIZE];
+
+        if (modem_context_get_threshold (modem_ctx, entry->state) > 0) {
+            total += end - MAX (entry->time, window_start);
+            if (i == 1)
+                *unusable_now = TRUE;
+        }
+        end = entry->time;
+    }
+    return total;
+}
+
+/* Records why the network refused registration; NULL once it's accepted */
+static void
+modem_context_set_reject (ModemContext *modem_ctx, const RejectCause *reject)
+{
+    if (reject == modem_ctx->reject)
+        return;
+    if (reject && reject->action == REJECT_PERMANENT)
+        modem_message (modem_ctx, "registration refused (%s); only re-registering every %d seconds",
+                       reject->name, modem_ctx->ctx->config.reject_holdoff);
+    else if (reject)
+        modem_message (modem_ctx, "registration refused (%s); only re-registering", reject->name);
+    else
+        modem_message (modem_ctx, "network accepts registration again");
+    modem_ctx->reject = reject;
+}
+
+/* Updates the failure clock and kick deadline for @reg_state and the
+ * current configuration.
+ */
+static void
+modem_context_update_registration (ModemContext *modem_ctx, MMModem3gppRegistrationState reg_state)
+{
+    guint threshold;
+
+    modem_context_record_state (modem_ctx, reg_state);
+    threshold = modem_context_get_threshold (modem_ctx, reg_state);
+    if (threshold > 0) {
+        /* keep counting from the first failure, but use this state's threshold */
+        modem_ctx->threshold = threshold;
+        if (modem_ctx->timestamp == 0) {
+            modem_ctx->timestamp = get_monotonic_time ();
+            modem_message (modem_ctx, "save idle/denied timestamp %" G_GINT64_FORMAT, modem_ctx->timestamp);
+        }
+    } else if (modem_ctx->timestamp) {
+        /* A kick takes the modem through unknown/searching on its own; keep
+         * the failure clock running unless it actually registers.
+         */
+        if (reg_state_is_registered (reg_state) ||
+            (modem_ctx->op_state == MODEM_OP_STATE_NONE && get_monotonic_time () >= modem_ctx->kick_verify_until)) {
+            modem_message (modem_ctx, "registered; clearing idle/denied timestamp");
+            modem_ctx->timestamp = 0;
+        }
+    }
+
+    if (reg_state_is_registered (reg_state)) {
+        modem_context_set_reject (modem_ctx, NULL);
+        modem_context_verify_kick (modem_ctx, TRUE);
+    }
+    if (reg_state_is_registered (reg_state) && modem_ctx->kick_started) {
+        histogram_observe (&modem_ctx->ctx->metrics->recovery[modem_ctx->tier],
+                           get_monotonic_time () - modem_ctx->kick_started);
+        modem_ctx->kick_started = 0;
+    }
+
+    if (reg_state_is_registered (reg_state) &&
+        (modem_ctx->next_tier != modem_context_first_tier (modem_ctx) || modem_ctx->kick_backoff.attempts)) {
+        modem_message (modem_ctx, "registration recovered; resetting recovery ladder");
+        modem_ctx->kick_holdoff = 0;
+        modem_ctx->kick_verify_until = 0;
+        modem_ctx->next_tier = modem_context_first_tier (modem_ctx);
+        backoff_reset (&modem_ctx->kick_backoff);
+        backoff_reset (&modem_ctx->retry_backoff);
+    }
+
+    /* the rest of the kick, queued for a slot or between steps, would only
+     * disturb a modem that works again
+     */
+    if (reg_state_is_registered (reg_state) && modem_ctx->op_state != MODEM_OP_STATE_NONE) {
+        modem_message (modem_ctx, "registered; dropping the rest of the kick (%s)", kick_tiers[modem_ctx->tier].name);
+        modem_context_finish_kick (modem_ctx);
+    }
+
+    modem_context_store_state (modem_ctx);
+    modem_update_kick_deadline (modem_ctx);
+}
+
+/* Data path probe */
+
+typedef enum {
+    PROBE_RESULT_UNKNOWN,  /* nothing to go by; keeps the last verdict */
+    PROBE_RESULT_HEALTHY,
+    PROBE_RESULT_STALLED,
+} ProbeResult;
+
+static void
+modem_context_cancel_probe (ModemContext *modem_ctx)
+{
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->probe_timer);
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->probe_timeout);
+    if (modem_ctx->probe_cancellable) {
+        g_cancellable_cancel (modem_ctx->probe_cancellable);
+        g_clear_object (&modem_ctx->probe_cancellable);
+    }
+    if (modem_ctx->probe) {
+        g_subprocess_force_exit (modem_ctx->probe);
+        g_clear_object (&modem_ctx->probe);
+    }
+}
+
+/* Probes a registered modem's data path, and stops once it isn't. A probe
+ * running or due is left alone.
+ */
+static void
+modem_context_update_probe (ModemContext *modem_ctx, MMModem3gppRegistrationState reg_state)
+{
+    Context *ctx = modem_ctx->ctx;
+
+    if (ctx->config.probe_interval == 0) {
+        modem_context_cancel_probe (modem_ctx);
+        modem_ctx->data_stalled = FALSE;
+        return;
+    }
+    /* a replay has no interfaces to look at */
+    if (!modem_ctx->modem || time_is_virtual || !reg_state_is_registered (reg_state)) {
+        modem_context_cancel_probe (modem_ctx);
+        return;
+    }
+    if (modem_ctx->probe_cancellable || timer_is_armed (&modem_ctx->probe_timer))
+        return;
+
+    backoff_reset (&modem_ctx->probe_backoff);
+    scheduler_arm (ctx->scheduler, &modem_ctx->probe_timer,
+                   get_monotonic_time () + (gint64) ctx->config.probe_interval * G_USEC_PER_SEC);
+}
+
+static void
+modem_context_probe_done (ModemContext *modem_ctx, ProbeResult result)
+{
+    gint64 delay;
+
+    g_clear_object (&modem_ctx->probe_cancellable);
+    g_clear_object (&modem_ctx->probe);
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->probe_timeout);
+
+    /* check a dead data path again soon, whether a kick brought it back */
+    if (result == PROBE_RESULT_STALLED || (result == PROBE_RESULT_UNKNOWN && modem_ctx->data_stalled)) {
+        backoff_reset (&modem_ctx->probe_backoff);
+        delay = (gint64) modem_ctx->ctx->config.probe_interval * G_USEC_PER_SEC;
+    } else
+        delay = backoff_next (&modem_ctx->probe_backoff);
+    scheduler_arm (modem_ctx->ctx->scheduler, &modem_ctx->probe_timer, get_monotonic_time () + delay);
+
+    if (result == PROBE_RESULT_UNKNOWN || (result == PROBE_RESULT_STALLED) == modem_ctx->data_stalled)
+        return;
+    modem_ctx->data_stalled = (result == PROBE_RESULT_STALLED);
+    if (modem_ctx->data_stalled) {
+        modem_ctx->ctx->metrics->data_stalls++;
+        modem_message (modem_ctx, "registered, but no data came in on %s; counting as idle", modem_ctx->probe_iface);
+    } else
+        modem_message (modem_ctx, "data flowing again on %s", modem_ctx->probe_iface);
+    modem_update_registration (modem_ctx->object);
+}
+
+/* Gives up on probe_command, as if it had failed */
+static void
+modem_probe_timeout_cb (ModemContext *modem_ctx)
+{
+    modem_warning (modem_ctx, "probe command didn't finish within %d seconds", modem_ctx->ctx->config.probe_interval);
+    g_cancellable_cancel (modem_ctx->probe_cancellable);
+    g_subprocess_force_exit (modem_ctx->probe);
+    modem_context_probe_done (modem_ctx, PROBE_RESULT_STALLED);
+}
+
+static void
+modem_probe_command_ready (GSubprocess *probe, GAsyncResult *res, ModemContext *modem_ctx)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!g_subprocess_wait_finish (probe, res, &error)) {
+        /* canceled along with the probe; modem_ctx may be gone already */
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            modem_warning (modem_ctx, "couldn't wait for probe command: '%s'", error->message);
+            modem_context_probe_done (modem_ctx, PROBE_RESULT_UNKNOWN);
+        }
+        return;
+    }
+    modem_context_probe_done (modem_ctx, g_subprocess_get_successful (probe) ? PROBE_RESULT_HEALTHY : PROBE_RESULT_STALLED);
+}
+
+/* Asks probe_command whether anything answers through the interface.
+ * Returns FALSE if there is no command, or it couldn't be run.
+ */
+static gboolean
+modem_context_run_probe_command (ModemContext *modem_ctx)
+{
+    const Config      *config = &modem_ctx->ctx->config;
+    g_autoptr(GError)  error = NULL;
+    const gchar       *argv[] = { config->probe_command, modem_ctx->probe_iface, modem_ctx->path, NULL };
+
+    if (!config->probe_command[0])
+        return FALSE;
+
+    modem_ctx->probe = g_subprocess_newv (argv, G_SUBPROCESS_FLAGS_NONE, &error);
+    if (!modem_ctx->probe) {
+        modem_warning (modem_ctx, "couldn't run probe command %s: '%s'", config->probe_command, error->message);
+        return FALSE;
+    }
+    g_subprocess_wait_async (modem_ctx->probe,
+                             modem_ctx->probe_cancellable,
+                             (GAsyncReadyCallback) modem_probe_command_ready,
+                             modem_ctx);
+    scheduler_arm (modem_ctx->ctx->scheduler, &modem_ctx->probe_timeout,
+                   get_monotonic_time () + (gint64) config->probe_interval * G_USEC_PER_SEC);
+    return TRUE;
+}
+
+/* Reads one of @iface's statistics counters, the ones netlink reports too */
+static gboolean
+read_interface_counter (const gchar *iface, const gchar *name, guint64 *value)
+{
+    g_autofree gchar *path = NULL;
+    g_autofree gchar *contents = NULL;
+
+    path = g_strdup_printf ("/sys/class/net/%s/statistics/%s", iface, name);
+    if (!g_file_get_contents (path, &contents, NULL, NULL))
+        return FALSE;
+    *value = g_ascii_strtoull (contents, NULL, 10);
+    return TRUE;
+}
+
+static void
+modem_probe_bearers_ready (MMModem *modem, GAsyncResult *res, ModemContext *modem_ctx)
+{
+    g_autoptr(GError)  error = NULL;
+    g_autofree gchar  *iface = NULL;
+    GList             *bearers;
+    GList             *l;
+    guint64            rx_bytes;
+    guint64            tx_bytes;
+    gboolean           sampled;
+    gboolean           received;
+    gboolean           sent;
+
+    bearers = mm_modem_list_bearers_finish (modem, res, &error);
+    if (!bearers && error) {
+        /* canceled along with the probe; modem_ctx may be gone already */
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            modem_warning (modem_ctx, "couldn't list bearers: '%s'", error->message);
+            modem_context_probe_done (modem_ctx, PROBE_RESULT_UNKNOWN);
+        }
+        return;
+    }
+    for (l = bearers; l && !iface; l = l->next) {
+        if (mm_bearer_get_connected (l->data))
+            iface = g_strdup (mm_bearer_get_interface (l->data));
+    }
+    g_list_free_full (bearers, (GDestroyNotify) g_object_unref);
+
+    /* no data connection to judge */
+    if (!iface ||
+        !read_interface_counter (iface, "rx_bytes", &rx_bytes) ||
+        !read_interface_counter (iface, "tx_bytes", &tx_bytes)) {
+        modem_context_probe_done (modem_ctx, PROBE_RESULT_UNKNOWN);
+        return;
+    }
+    /* a bearer on another interface starts counting over */
+    sampled = g_strcmp0 (modem_ctx->probe_iface, iface) == 0;
+    received = sampled && rx_bytes > modem_ctx->rx_bytes;
+    sent = sampled && tx_bytes > modem_ctx->tx_bytes;
+    g_free (modem_ctx->probe_iface);
+    modem_ctx->probe_iface = g_steal_pointer (&iface);
+    modem_ctx->rx_bytes = rx_bytes;
+    modem_ctx->tx_bytes = tx_bytes;
+
+    if (!sampled || received) {
+        modem_context_probe_done (modem_ctx, received ? PROBE_RESULT_HEALTHY : PROBE_RESULT_UNKNOWN);
+        return;
+    }
+    /* nothing came back: a quiet link if nothing went out either, unless the
+     * command finds otherwise
+     */
+    if (modem_context_run_probe_command (modem_ctx))
+        return;
+    modem_context_probe_done (modem_ctx, sent ? PROBE_RESULT_STALLED : PROBE_RESULT_UNKNOWN);
+}
+
+static void
+modem_probe_cb (ModemContext *modem_ctx)
+{
+    modem_ctx->probe_cancellable = g_cancellable_new ();
+    mm_modem_list_bearers (modem_ctx->modem,
+                           modem_ctx->probe_cancellable,
+                           (GAsyncReadyCallback) modem_probe_bearers_ready,
+                           modem_ctx);
+}
+
+static void
+modem_update_registration (MMObject *modem_object)
+{
+    ModemContext                 *modem_ctx = get_modem_context (modem_object);
+    MMModem3gppRegistrationState  reg_state;
+
+    reg_state = modem_ctx->source->get_state (modem_ctx->source_object, modem_ctx->modem);
+    modem_context_update_probe (modem_ctx, reg_state);
+    /* registered without a working data path is as good as idle */
+    if (modem_ctx->data_stalled && reg_state_is_registered (reg_state))
+        reg_state = MM_MODEM_3GPP_REGISTRATION_STATE_IDLE;
+    modem_context_update_registration (modem_ctx, reg_state);
+}
+
+static void
+modem_signal_quality_changed (MMModem *modem, GParamSpec *pspec, MMObject *modem_object)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+    gboolean      recent = FALSE;
+    guint         quality;
+    gboolean      no_signal;
+
+    /* A stale value says nothing about the radio; don't hold kicks on it.
+     * The access technology isn't used: it is unknown for any modem that
+     * isn't registered, whether or not there is signal.
+     */
+    quality = mm_modem_get_signal_quality (modem, &recent);
+    no_signal = recent && quality == 0;
+    if (no_signal == modem_ctx->no_signal)
+        return;
+
+    modem_ctx->no_signal = no_signal;
+    if (no_signal)
+        modem_message (modem_ctx, "no signal");
+    else
+        modem_message (modem_ctx, "signal quality now %u%%", quality);
+    modem_update_kick_deadline (modem_ctx);
+}
+
+static void
+modem_registration_changed (GObject *source_object, GParamSpec *pspec, MMObject *modem_object)
+{
+    ModemContext                 *modem_ctx = get_modem_context (modem_object);
+    MMModem3gppRegistrationState  reg_state;
+
+    reg_state = modem_ctx->source->get_state (modem_ctx->source_object, modem_ctx->modem);
+    /* a source that maps several properties notifies more often than the
+     * state it derives changes
+     */
+    if (pspec && modem_ctx->history_len &&
+        modem_ctx->history[(modem_ctx->history_next + HISTORY_SIZE - 1) % HISTORY_SIZE].state == reg_state)
+        return;
+    /* the initial state (no @pspec) isn't a change */
+    if (pspec)
+        modem_ctx->ctx->metrics->registration_changes++;
+    if (reg_state == MM_MODEM_3GPP_REGISTRATION_STATE_DENIED && modem_ctx->reject)
+        modem_message (modem_ctx, "registration changed to %s (%s)",
+                       mm_modem_3gpp_registration_state_get_string (reg_state), modem_ctx->reject->name);
+    else
+        modem_message (modem_ctx, "registration changed to %s", mm_modem_3gpp_registration_state_get_string (reg_state));
+    modem_update_registration (modem_object);
+}
+
+/*****************************************************************************/
+
+/* Bookkeeping once a kick has run its course: frees its slot and moves the
+ * recovery ladder on unless registration has already come back.
+ */
+static void
+modem_context_finish_kick (ModemContext *modem_ctx)
+{
+    gint64       now = get_monotonic_time ();
+    GSubprocess *hook;
+
+    modem_context_cancel_op (modem_ctx);
+    modem_context_release_slot (modem_ctx);
+
+    /* Judge the kick by registration alone; only a fresh stalled verdict
+     * from the next probe may call for another one.
+     */
+    if (modem_ctx->data_stalled) {
+        modem_ctx->data_stalled = FALSE;
+        if (modem_ctx->state_changed_id)
+            modem_update_registration (modem_ctx->object);
+    }
+
+    /* nobody waits for this one */
+    hook = modem_context_spawn_hook (modem_ctx, "post-kick", modem_ctx->tier,
+                                     modem_ctx->timestamp ? "failing" : "registered");
+    g_clear_object (&hook);
+
+    /* Give registration a moment to come back; if it doesn't, escalate.
+     * Once the ladder is exhausted, repeat the last tier with backoff.
+     * A successful registration resets both.
+     */
+    if (modem_ctx->timestamp == 0) {
+        /* already registered again while the kick was running */
+        modem_ctx->next_tier = modem_context_first_tier (modem_ctx);
+        modem_ctx->kick_holdoff = 0;
+        return;
+    }
+    modem_ctx->kick_verify_until = now + ((gint64) modem_ctx->ctx->config.verify * G_USEC_PER_SEC);
+    scheduler_arm (modem_ctx->ctx->scheduler, &modem_ctx->verify_timer, modem_ctx->kick_verify_until);
+    if (!modem_context_is_last_tier (modem_ctx, modem_ctx->tier)) {
+        modem_ctx->ctx->metrics->escalations++;
+        modem_ctx->next_tier = modem_context_tier_from (modem_ctx, modem_ctx->tier + 1);
+        modem_ctx->kick_holdoff = modem_ctx->kick_verify_until;
+    } else {
+        modem_ctx->next_tier = modem_ctx->tier;
+        if (modem_ctx->reject && modem_ctx->reject->action == REJECT_PERMANENT)
+            modem_ctx->kick_holdoff = now + (gint64) modem_ctx->ctx->config.reject_holdoff * G_USEC_PER_SEC;
+        else
+            modem_ctx->kick_holdoff = now + backoff_next (&modem_ctx->kick_backoff);
+    }
+    modem_context_store_state (modem_ctx);
+}
+
+static void
+modem_context_attach (ModemContext *modem_ctx, MMObject *modem_object, MMModem *modem,
+                      const RegistrationSource *source, gpointer source_object)
+{
+    modem_ctx->object = modem_object;
+    modem_ctx->path = mm_object_get_path (modem_object);
+    modem_ctx->modem = modem;
+    modem_ctx->modem_3gpp = mm_object_peek_modem_3gpp (modem_object);
+    modem_ctx->source = source;
+    modem_ctx->source_object = source_object;
+    g_free (modem_ctx->model);
+    modem_ctx->model = g_strdup_printf ("%s %s", mm_modem_get_manufacturer (modem), mm_modem_get_model (modem));
+    g_object_set_data (G_OBJECT (modem_object), "modem-context", modem_ctx);
+    timer_init (&modem_ctx->kick_timer, (TimerFunc) modem_kick_cb, modem_object);
+    timer_init (&modem_ctx->op_timer, (TimerFunc) modem_op_state_run, modem_object);
+    modem_context_configure (modem_ctx);
+
+    /* The new object starts out in unknown/searching; give it time to get
+     * back to where the old one was before the failure clock stops
+     */
+    if (modem_ctx->timestamp)
+        modem_ctx->kick_verify_until = MAX (modem_ctx->kick_verify_until,
+                                            get_monotonic_time () + ((gint64) modem_ctx->ctx->config.verify * G_USEC_PER_SEC));
+    if (modem_ctx->kick_unverified)
+        scheduler_arm (modem_ctx->ctx->scheduler, &modem_ctx->verify_timer, modem_ctx->kick_verify_until);
+}
+
+/* Unbinds the context from its object, which ModemManager has removed or
+ * is about to. Pending kicks stop; the failure clock keeps running.
+ */
+static void
+modem_context_detach (ModemContext *modem_ctx)
+{
+    guint i;
+
+    for (i = 0; i < N_SOURCE_SIGNALS; i++) {
+        if (modem_ctx->reg_state_changed_ids[i])
+            g_signal_handler_disconnect (modem_ctx->source_object, modem_ctx->reg_state_changed_ids[i]);
+        modem_ctx->reg_state_changed_ids[i] = 0;
+    }
+    if (modem_ctx->state_changed_id)
+        g_signal_handler_disconnect (modem_ctx->modem, modem_ctx->state_changed_id);
+    if (modem_ctx->power_state_changed_id)
+        g_signal_handler_disconnect (modem_ctx->modem, modem_ctx->power_state_changed_id);
+    if (modem_ctx->signal_quality_changed_id)
+        g_signal_handler_disconnect (modem_ctx->modem, modem_ctx->signal_quality_changed_id);
+    modem_ctx->state_changed_id = 0;
+    modem_ctx->power_state_changed_id = 0;
+    modem_ctx->signal_quality_changed_id = 0;
+
+    modem_context_cancel_kick (modem_ctx);
+    modem_context_cancel_probe (modem_ctx);
+    /* A reset makes ModemManager re-probe the modem; count the kick as done */
+    if (modem_ctx->op_state != MODEM_OP_STATE_NONE) {
+        modem_message (modem_ctx, "removed while being kicked (%s)", kick_tiers[modem_ctx->tier].name);
+        modem_context_finish_kick (modem_ctx);
+    }
+    modem_context_cancel_op (modem_ctx);
+    modem_context_release_slot (modem_ctx);
+
+    g_object_set_data (G_OBJECT (modem_ctx->object), "modem-context", NULL);
+    modem_ctx->object = NULL;
+    modem_ctx->path = modem_ctx->equipment_id;
+    modem_ctx->modem = NULL;
+    modem_ctx->modem_3gpp = NULL;
+    modem_ctx->source = NULL;
+    modem_ctx->source_object = NULL;
+    modem_ctx->no_signal = FALSE;
+}
+
+/* GDestroyNotify for ctx->modems */
+static void
+modem_object_detach (MMObject *modem_object)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+    Context      *ctx = modem_ctx->ctx;
+
+    modem_context_detach (modem_ctx);
+    /* Nothing worth keeping about a healthy modem, or one we can't
+     * recognize when it comes back
+     */
+    if (!modem_ctx->equipment_id ||
+        (modem_ctx->timestamp == 0 && modem_ctx->next_tier == modem_context_first_tier (modem_ctx) &&
+         !modem_ctx->kick_backoff.attempts))
+        g_hash_table_remove (ctx->devices, modem_ctx->equipment_id ? modem_ctx->equipment_id : mm_object_get_path (modem_object));
+    g_object_unref (modem_object);
+}
+
+static void ensure_manager (Context *ctx);
+
+static void
+context_attach_modem (Context *ctx, MMObject *modem_object)
+{
+    const gchar  *path;
+    const gchar  *equipment_id;
+    MMModem      *modem_iface = NULL;
+    const RegistrationSource *source = NULL;
+    gpointer      source_object = NULL;
+    ModemContext *modem_ctx;
+    guint         i;
+
+    path = mm_object_get_path (modem_object);
+
+    /* Ensure we have the 'Modem' interface at least */
+    modem_iface = mm_object_peek_modem (modem_object);
+    if (!modem_iface) {
+        g_warning ("Error: modem %s had no modem interface", path);
+        return;
+    }
+
+    /* Ensure we have a primary port reported */
+    if (!mm_modem_get_primary_port (modem_iface)) {
+        g_warning ("Error: modem %s had no primary port", path);
+        return;
+    }
+
+    for (i = 0; !source_object; i++) {
+        source = &registration_sources[i];
+        source_object = source->peek (modem_object);
+    }
+
+    g_message ("%s: added (%s registration)", path, source->name);
+    equipment_id = mm_modem_get_equipment_identifier (modem_iface);
+    modem_ctx = equipment_id ? g_hash_table_lookup (ctx->devices, equipment_id) : NULL;
+    if (modem_ctx && modem_ctx->object) {
+        g_warning ("Error: %s has the same equipment identifier as %s", path, modem_ctx->path);
+        equipment_id = NULL;
+        modem_ctx = NULL;
+    }
+    if (modem_ctx) {
+        g_message ("%s: was %s before", path, modem_ctx->path);
+        modem_context_attach (modem_ctx, modem_object, modem_iface, source, source_object);
+    } else {
+        modem_ctx = modem_context_new (ctx, equipment_id);
+        g_hash_table_insert (ctx->devices, g_strdup (equipment_id ? equipment_id : path), modem_ctx);
+        modem_context_attach (modem_ctx, modem_object, modem_iface, source, source_object);
+        modem_context_restore_state (modem_ctx);
+    }
+
+    for (i = 0; i < N_SOURCE_SIGNALS && source->signals[i]; i++)
+        modem_ctx->reg_state_changed_ids[i] = g_signal_connect (source_object,
+                                                                source->signals[i],
+                                                                G_CALLBACK (modem_registration_changed),
+                                                                modem_object);
+    modem_registration_changed (source_object, NULL, modem_object);
+
+    modem_ctx->state_changed_id = g_signal_connect (modem_iface,
+                                                    "notify::state",
+                                                    G_CALLBACK (modem_state_changed),
+                                                    modem_object);
+    modem_ctx->power_state_changed_id = g_signal_connect (modem_iface,
+                                                          "notify::power-state",
+                                                          G_CALLBACK (modem_state_changed),
+                                                          modem_object);
+    modem_ctx->signal_quality_changed_id = g_signal_connect (modem_iface,
+                                                             "notify::signal-quality",
+                                                             G_CALLBACK (modem_signal_quality_changed),
+                                                             modem_object);
+    modem_signal_quality_changed (modem_iface, NULL, modem_object);
+
+    g_hash_table_insert (ctx->modems, g_strdup (path), g_object_ref (modem_object));
+}
+
+static gboolean
+attach_next_modem (gpointer user_data)
+{
+    Context  *ctx = user_data;
+    MMObject *modem_object;
+
+    modem_object = g_queue_pop_head (&ctx->attach_queue);
+    context_attach_modem (ctx, modem_object);
+    g_object_unref (modem_object);
+
+    if (!g_queue_is_empty (&ctx->attach_queue))
+        return G_SOURCE_CONTINUE;
+    ctx->attach_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* Queues @modem_object to be attached from an idle callback. Attaching
+ * fetches the modem's properties; spreading that out keeps a host with many
+ * modems responsive while ModemManager (re)starts.
+ */
+static void
+handle_object_added (GDBusObjectManager *mm, MMObject *modem_object, Context *ctx)
+{
+    if (g_hash_table_contains (ctx->modems, mm_object_get_path (modem_object)) ||
+        g_queue_find (&ctx->attach_queue, modem_object))
+        return;
+
+    g_queue_push_tail (&ctx->attach_queue, g_object_ref (modem_object));
+    if (!ctx->attach_id)
+        ctx->attach_id = g_idle_add (attach_next_modem, ctx);
+}
+
+static void
+handle_object_removed (GDBusObjectManager *manager, MMObject *modem_object, Context *ctx)
+{
+    const gchar *path = mm_object_get_path (modem_object);
+
+    if (g_queue_remove (&ctx->attach_queue, modem_object)) {
+        g_object_unref (modem_object);
+        return;
+    }
+    g_message ("%s: removed", path);
+    g_hash_table_remove (ctx->modems, path);
+}
+
+static void
+mm_available (Context *ctx)
+{
+    GList *modems, *l;
+
+    /* Get initial modems */
+    modems = g_dbus_object_manager_get_objects (ctx->mm);
+    for (l = modems; l; l = g_list_next(l)) {
+        handle_object_added (ctx->mm, MM_OBJECT (l->data), ctx);
+    }
+    g_list_free_full (modems, (GDestroyNotify) g_object_unref);
+}
+
+static void
+check_name_owner (Context *ctx)
+{
+    g_autofree gchar *name_owner = NULL;
+
+    name_owner = g_dbus_object_manager_client_get_name_owner (G_DBUS_OBJECT_MANAGER_CLIENT (ctx->mm));
+    ctx->mm_missed_owner = !name_owner;
+    if (name_owner) {
+        g_message ("ModemManager is running");
+        mm_available (ctx);
+    } else {
+        g_message ("ModemManager is not running");
+    }
+}
+
+static void
+handle_name_owner_changed (GDBusObjectManager *modem_manager, GParamSpec *pspec, Context *ctx)
+{
+    g_autofree gchar *name_owner = NULL;
+
+    name_owner = g_dbus_object_manager_client_get_name_owner (G_DBUS_OBJECT_MANAGER_CLIENT (ctx->mm));
+    if (!name_owner) {
+        g_message ("ModemManager no longer running");
+        context_clear_modems (ctx);
+    } else {
+        g_message ("ModemManager now running");
+
+        /* Hack: GDBusObjectManagerClient won't signal object events if it was
+         * created while MM was not on the bus. Work around that by recreating the
+         * manager when MM shows up. Or get a fixed GIO. A manager created while
+         * MM was running keeps working across MM restarts, so keep that one.
+         */
+        if (ctx->mm_missed_owner) {
+            context_clear_manager (ctx);
+            ensure_manager (ctx);
+        } else {
+            mm_available (ctx);
+        }
+    }
+}
+
+static void
+modem_manager_new_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    Context           *ctx = user_data;
+    g_autoptr(GError)  error = NULL;
+
+    /* MMManager is a GDBusObjectManagerClient; either finish works */
+    ctx->mm = g_dbus_object_manager_client_new_finish (res, &error);
+    if (!ctx->mm) {
+        g_warning ("Error: failed to connect to ModemManager: %s", error->message);
+        return;
+    }
+    g_message ("Watching D-Bus for ModemManager...");
+
+    /* Setup signals in the GDBusObjectManagerClient */
+    ctx->name_owner_changed_id = g_signal_connect (ctx->mm,
+                                                   "notify::name-owner",
+                                                   G_CALLBACK (handle_name_owner_changed),
+                                                   ctx);
+    ctx->object_added_id = g_signal_connect (ctx->mm,
+                                             "object-added",
+                                             G_CALLBACK (handle_object_added),
+                                             ctx);
+    ctx->object_removed_id = g_signal_connect (ctx->mm,
+                                               "object-removed",
+                                               G_CALLBACK (handle_object_removed),
+                                               ctx);
+
+    check_name_owner (ctx);
+}
+
+/* Minimal proxies: MMObject, MMModem, MMModem3gpp and MMModemCdma are all
+ * we use; every other interface (SIM, bearers, location, messaging...) gets
+ * a plain GDBusProxy instead of its libmm-glib wrapper.
+ */
+static GType
+minimal_get_proxy_type (GDBusObjectManagerClient *manager,
+                        const gchar              *object_path,
+                        const gchar              *interface_name,
+                        gpointer                  user_data)
+{
+    if (!interface_name)
+        return MM_TYPE_OBJECT;
+    if (g_str_equal (interface_name, MM_DBUS_INTERFACE_MODEM))
+        return MM_TYPE_MODEM;
+    if (g_str_equal (interface_name, MM_DBUS_INTERFACE_MODEM_MODEM3GPP))
+        return MM_TYPE_MODEM_3GPP;
+    if (g_str_equal (interface_name, MM_DBUS_INTERFACE_MODEM_MODEMCDMA))
+        return MM_TYPE_MODEM_CDMA;
+    return G_TYPE_DBUS_PROXY;
+}
+
+static void
+ensure_manager (Context *ctx)
+{
+    if (ctx->config.minimal_proxies) {
+        g_dbus_object_manager_client_new (ctx->connection,
+                                          G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_DO_NOT_AUTO_START,
+                                          MM_DBUS_SERVICE,
+                                          MM_DBUS_PATH,
+                                          minimal_get_proxy_type,
+                                          NULL,
+                                          NULL,
+                                          ctx->cancellable,
+                                          modem_manager_new_cb,
+                                          ctx);
+        return;
+    }
+
+    mm_manager_new (ctx->connection,
+                    G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_DO_NOT_AUTO_START,
+                    ctx->cancellable,
+                    modem_manager_new_cb,
+                    ctx);
+}
+
+static void
+bus_get_ready (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    Context           *ctx = user_data;
+    g_autoptr(GError)  error = NULL;
+    GDBusConnection   *connection;
+
+    connection = g_bus_get_finish (res, &error);
+    if (!connection) {
+        g_warning ("Error: failed to connect to D-Bus: %s", error->message);
+        g_main_loop_quit (ctx->loop);
+        return;
+    }
+    ctx->connection = connection;
+
+    context_export (ctx);
+    ensure_manager (ctx);
+}
+
+/*****************************************************************************/
+/* Power backends for the hardware tier. Cutting power makes ModemManager
+ * drop the modem, so switching it back on is up to a PowerJob of the
+ * context's rather than to the modem's op state machine.
+ */
+
+typedef struct {
+    Context     *ctx;
+    gchar       *path;      /* sysfs attribute to write on_value to */
+    const gchar *on_value;
+    Timer        timer;
+} PowerJob;
+
+static gboolean
+sysfs_write (const gchar *path, const gchar *value, GError **error)
+{
+    gint fd;
+
+    fd = open (path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write (fd, value, strlen (value)) < 0) {
+        gint errsv = errno;
+
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                     "failed to write %s to %s: %s", value, path, g_strerror (errsv));
+        if (fd >= 0)
+            close (fd);
+        return FALSE;
+    }
+    close (fd);
+    return TRUE;
+}
+
+static void
+power_job_restore (PowerJob *job)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (sysfs_write (job->path, job->on_value, &error))
+        g_message ("power: %s back on", job->path);
+    else
+        g_warning ("Error: couldn't restore power: %s", error->message);
+
+    scheduler_cancel (job->ctx->scheduler, &job->timer);
+    g_ptr_array_remove (job->ctx->power_jobs, job);
+    g_free (job->path);
+    g_slice_free (PowerJob, job);
+}
+
+static void
+context_restore_power (Context *ctx)
+{
+    while (ctx->power_jobs->len)
+        power_job_restore (g_ptr_array_index (ctx->power_jobs, 0));
+}
+
+/* Writes @off_value to @path now and @on_value after the off time */
+static gboolean
+context_switch_off (Context *ctx, const gchar *path, const gchar *off_value, const gchar *on_value, GError **error)
+{
+    PowerJob *job;
+    guint     i;
+
+    /* several modems may share a line */
+    for (i = 0; i < ctx->power_jobs->len; i++) {
+        if (g_str_equal (((PowerJob *) g_ptr_array_index (ctx->power_jobs, i))->path, path))
+            return TRUE;
+    }
+    if (!sysfs_write (path, off_value, error))
+        return FALSE;
+
+    job = g_slice_new0 (PowerJob);
+    job->ctx = ctx;
+    job->path = g_strdup (path);
+    job->on_value = on_value;
+    timer_init (&job->timer, (TimerFunc) power_job_restore, job);
+    scheduler_arm (ctx->scheduler, &job->timer, get_monotonic_time () + (gint64) ctx->config.power_off_time * G_USEC_PER_SEC);
+    g_ptr_array_add (ctx->power_jobs, job);
+    return TRUE;
+}
+
+static void
+power_command_ready (GSubprocess *command, GAsyncResult *res, gchar *device)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!g_subprocess_wait_check_finish (command, res, &error))
+        g_warning ("Error: power command for %s failed: %s", device, error->message);
+    g_object_unref (command);
+    g_free (device);
+}
+
+/* Cuts the modem's power with the configured backend; it comes back on its
+ * own after config.power_off_time.
+ */
+static gboolean
+modem_context_cut_power (ModemContext *modem_ctx, GError **error)
+{
+    Context          *ctx = modem_ctx->ctx;
+    const Config     *config = &ctx->config;
+    const gchar      *device = mm_modem_get_device (modem_ctx->modem);
+    g_autofree gchar *path = NULL;
+    g_autofree gchar *off_time = NULL;
+    GSubprocess      *command;
+
+    if (g_str_equal (config->power_backend, "gpio"))
+        return context_switch_off (ctx, config->power_gpio,
+                                   config->power_gpio_active_low ? "1" : "0",
+                                   config->power_gpio_active_low ? "0" : "1",
+                                   error);
+
+    if (!device) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "ModemManager doesn't know the modem's device");
+        return FALSE;
+    }
+
+    /* deauthorizing the USB device unbinds its drivers; reauthorizing it
+     * has them probe it from scratch
+     */
+    if (g_str_equal (config->power_backend, "authorized")) {
+        path = g_build_filename (device, "authorized", NULL);
+        return context_switch_off (ctx, path, "0", "1", error);
+    }
+
+    /* e.g. a wrapper around uhubctl; it switches power back on itself */
+    off_time = g_strdup_printf ("%d", config->power_off_time);
+    command = g_subprocess_new (G_SUBPROCESS_FLAGS_NONE, error, config->power_command, device, off_time, NULL);
+    if (!command)
+        return FALSE;
+    g_subprocess_wait_check_async (command, NULL, (GAsyncReadyCallback) power_command_ready, g_strdup (device));
+    return TRUE;
+}
+
+/*****************************************************************************/
+
+static void modem_schedule_op_state_full (MMObject *modem_object, OpState new_state, gint64 delay, gboolean early);
+static void modem_schedule_op_state (MMObject *modem_object, OpState new_state);
+
+/* Starts the current tier from its first step */
+static void
+modem_start_tier (MMObject *modem_object)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+
+    modem_ctx->step = 0;
+    modem_ctx->tries = 0;
+    modem_ctx->op_state = MODEM_OP_STATE_NONE;
+    /* counted per tier entered, as results go to the tier a kick ends with */
+    modem_ctx->ctx->metrics->kicks[modem_ctx->tier]++;
+    if (modem_ctx->ctx->fake_mm)
+        modem_ctx->ctx->fake_mm->tier_started (modem_object, modem_ctx->ctx->fake_mm_data);
+    modem_schedule_op_state (modem_object, kick_tiers[modem_ctx->tier].steps[0]);
+}
+
+static void
+modem_schedule_next_op_state (MMObject *modem_object)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+
+    modem_ctx->step++;
+    modem_ctx->tries = 0;
+    modem_schedule_op_state (modem_object, kick_tiers[modem_ctx->tier].steps[modem_ctx->step]);
+}
+
+static void
+modem_schedule_retry_op_state (MMObject *modem_object)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+    gint64        delay;
+
+    modem_ctx->tries++;
+    if (modem_ctx->reject && modem_ctx->reject->action == REJECT_PERMANENT) {
+        /* asking again right away won't change the network's mind */
+        modem_message (modem_ctx, "registration refused (%s); failing operation", modem_ctx->reject->name);
+        modem_schedule_op_state_full (modem_object, MODEM_OP_STATE_FINISH,
+                                      (gint64) modem_ctx->step_delay * G_USEC_PER_SEC, TRUE);
+    } else if (modem_ctx->tries > (guint) modem_ctx->ctx->config.max_tries) {
+        if (!modem_context_is_last_tier (modem_ctx, modem_ctx->tier)) {
+            KickTier next = modem_context_tier_from (modem_ctx, modem_ctx->tier + 1);
+
+            modem_ctx->ctx->metrics->escalations++;
+            modem_message (modem_ctx, "too many retries; escalating from %s to %s",
+                           kick_tiers[modem_ctx->tier].name,
+                           kick_tiers[next].name);
+            modem_ctx->tier = next;
+            modem_start_tier (modem_object);
+        } else {
+            modem_message (modem_ctx, "too many retries; failing operation");
+            modem_schedule_op_state_full (modem_object, MODEM_OP_STATE_FINISH,
+                                          (gint64) modem_ctx->step_delay * G_USEC_PER_SEC, TRUE);
+        }
+    } else {
+        /* retry same op state; the modem already reports the previous one as
+         * done, so always wait out the full delay.
+         */
+        modem_ctx->ctx->metrics->step_retries++;
+        delay = backoff_next (&modem_ctx->retry_backoff);
+        modem_message (modem_ctx, "retrying in %" G_GINT64_FORMAT " seconds", delay / G_USEC_PER_SEC);
+        modem_schedule_op_state_full (modem_object, modem_ctx->op_state, delay, FALSE);
+    }
+}
+
+/* Whether ModemManager already reports the result of the step before the
+ * pending one, so the pending one can run right away.
+ */
+static gboolean
+modem_op_state_confirmed (ModemContext *modem_ctx)
+{
+    OpState prev = MODEM_OP_STATE_NONE;
+
+    /* a fake ModemManager's answer is all there is to the step */
+    if (modem_ctx->ctx->fake_mm)
+        return TRUE;
+    if (modem_ctx->step > 0)
+        prev = kick_tiers[modem_ctx->tier].steps[modem_ctx->step - 1];
+
+    switch (prev) {
+    case MODEM_OP_STATE_NONE:
+    case MODEM_OP_STATE_REGISTER:
+    case MODEM_OP_STATE_RESET:
+    case MODEM_OP_STATE_CUT_POWER:
+    case MODEM_OP_STATE_FINISH:
+        return TRUE;
+    case MODEM_OP_STATE_DISABLE:
+        return mm_modem_get_state (modem_ctx->modem) == MM_MODEM_STATE_DISABLED;
+    case MODEM_OP_STATE_LOW_POWER:
+        return mm_modem_get_power_state (modem_ctx->modem) == MM_MODEM_POWER_STATE_LOW;
+    case MODEM_OP_STATE_ENABLE:
+        return mm_modem_get_state (modem_ctx->modem) >= MM_MODEM_STATE_ENABLED;
+    }
+    return FALSE;
+}
+
+static void
+modem_op_state_check_confirmed (MMObject *modem_object)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+
+    if (!modem_ctx->op_early || !timer_is_armed (&modem_ctx->op_timer))
+        return;
+    if (!modem_op_state_confirmed (modem_ctx))
+        return;
+
+    modem_ctx->op_early = FALSE;
+    scheduler_arm (modem_ctx->ctx->scheduler, &modem_ctx->op_timer, get_monotonic_time ());
+}
+
+static void
+modem_state_changed (MMModem *modem, GParamSpec *pspec, MMObject *modem_object)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+
+    if (modem_ctx->source->modem_state && g_str_equal (pspec->name, "state"))
+        modem_registration_changed (G_OBJECT (modem), pspec, modem_object);
+    modem_op_state_check_confirmed (modem_object);
+}
+
+/* Moves to @new_state after @delay (usec), or as soon as ModemManager
+ * confirms the previous step if @early is set.
+ */
+static void
+modem_schedule_op_state_full (MMObject *modem_object, OpState new_state, gint64 delay, gboolean early)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+
+    modem_ctx->op_state = new_state;
+    modem_ctx->op_early = early;
+    g_assert (!timer_is_armed (&modem_ctx->op_timer));
+    scheduler_arm (modem_ctx->ctx->scheduler, &modem_ctx->op_timer, get_monotonic_time () + delay);
+    modem_op_state_check_confirmed (modem_object);
+}
+
+static void
+modem_schedule_op_state (MMObject *modem_object, OpState new_state)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+
+    modem_schedule_op_state_full (modem_object, new_state, (gint64) modem_ctx->step_delay * G_USEC_PER_SEC, TRUE);
+}
+
+/* Records how the op state issued last went */
+static void
+modem_op_state_done (MMObject *modem_object, gboolean success)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+    Metrics      *metrics = modem_ctx->ctx->metrics;
+
+    scheduler_cancel (modem_ctx->ctx->scheduler, &modem_ctx->step_timer);
+    if (success)
+        histogram_observe (&metrics->steps[modem_ctx->op_state], get_monotonic_time () - modem_ctx->op_started);
+    else
+        metrics->step_failures[modem_ctx->op_state]++;
+    /* settling doesn't need the slot; let another modem's step go */
+    modem_context_release_slot (modem_ctx);
+}
+
+/* Moves on from the op state's call once it has been answered */
+static void
+modem_op_state_answered (MMObject *modem_object, gboolean success)
+{
+    modem_op_state_done (modem_object, success);
+    if (success)
+        modem_schedule_next_op_state (modem_object);
+    else
+        modem_schedule_retry_op_state (modem_object);
+}
+
+/* Takes a slot for the pending op state's call, or queues up for one */
+static gboolean
+modem_context_take_slot (ModemContext *modem_ctx)
+{
+    Context *ctx = modem_ctx->ctx;
+
+    if (modem_ctx->has_slot)
+        return TRUE;
+    if (ctx->calls_running < (guint) ctx->config.max_concurrent) {
+        modem_ctx->has_slot = TRUE;
+        ctx->calls_running++;
+        return TRUE;
+    }
+    if (!modem_ctx->slot_queued) {
+        modem_message (modem_ctx, "waiting for %u other kick step(s) to finish", ctx->calls_running);
+        g_queue_push_tail (&ctx->slot_queue, modem_ctx->object);
+        modem_ctx->slot_queued = TRUE;
+    }
+    return FALSE;
+}
+
+/* Whether the op state whose call failed with @error still waits for it. A
+ * timeout or a new kick cancels modem_ctx->cancellable before moving on, so
+ * a reply to a canceled call belongs to an op that may already have been
+ * replaced by a new one.
+ */
+static gboolean
+modem_context_op_is_current (ModemContext *modem_ctx, const GError *error)
+{
+    return modem_ctx->op_state != MODEM_OP_STATE_NONE &&
+           !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+}
+
+static void
+modem_enable_ready (MMModem *modem_iface, GAsyncResult *res, MMObject *modem_object)
+{
+    ModemContext      *modem_ctx = get_modem_context (modem_object);
+    g_autoptr(GError)  error = NULL;
+
+    if (!mm_modem_enable_finish(modem_iface, res, &error)) {
+        if (modem_context_op_is_current (modem_ctx, error)) {
+            modem_warning (modem_ctx, "failed to enable: '%s'", error->message);
+            modem_op_state_answered (modem_object, FALSE);
+        }
+    } else
+        modem_op_state_answered (modem_object, TRUE);
+
+    g_object_unref (modem_object);
+}
+
+static void
+set_power_state_low_ready (MMModem *modem, GAsyncResult *result, MMObject *modem_object)
+{
+    ModemContext      *modem_ctx = get_modem_context (modem_object);
+    g_autoptr(GError) error = NULL;
+
+    if (!mm_modem_set_power_state_finish (modem, result, &error)) {
+        if (modem_context_op_is_current (modem_ctx, error)) {
+            modem_warning (modem_ctx, "failed to set low-power: '%s'", error->message);
+            modem_op_state_answered (modem_object, FALSE);
+        }
+    } else
+        modem_op_state_answered (modem_object, TRUE);
+
+    g_object_unref (modem_object);
+}
+
+static void
+modem_disable_ready (MMModem *modem_iface, GAsyncResult *res, MMObject *modem_object)
+{
+    ModemContext      *modem_ctx = get_modem_context (modem_object);
+    g_autoptr(GError)  error = NULL;
+
+    if (!mm_modem_disable_finish (modem_iface, res, &error)) {
+        if (modem_context_op_is_current (modem_ctx, error)) {
+            modem_warning (modem_ctx, "failed to disable: '%s'", error->message);
+            modem_op_state_answered (modem_object, FALSE);
+        }
+    } else
+        modem_op_state_answered (modem_object, TRUE);
+
+    g_object_unref (modem_object);
+}
+
+static void
+modem_register_ready (MMModem3gpp *modem_3gpp, GAsyncResult *res, MMObject *modem_object)
+{
+    ModemContext      *modem_ctx = get_modem_context (modem_object);
+    g_autoptr(GError)  error = NULL;
+
+    if (!mm_modem_3gpp_register_finish (modem_3gpp, res, &error)) {
+        if (modem_context_op_is_current (modem_ctx, error)) {
+            const RejectCause *reject = reject_cause_from_error (error);
+
+            modem_warning (modem_ctx, "failed to re-register: '%s'", error->message);
+            if (reject)
+                modem_context_set_reject (modem_ctx, reject);
+            modem_op_state_answered (modem_object, FALSE);
+        }
+    } else
+        modem_op_state_answered (modem_object, TRUE);
+
+    g_object_unref (modem_object);
+}
+
+static void
+modem_reset_ready (MMModem *modem_iface, GAsyncResult *res, MMObject *modem_object)
+{
+    ModemContext      *modem_ctx = get_modem_context (modem_object);
+    g_autoptr(GError)  error = NULL;
+
+    if (!mm_modem_reset_finish (modem_iface, res, &error)) {
+        if (modem_context_op_is_current (modem_ctx, error)) {
+            modem_warning (modem_ctx, "failed to reset: '%s'", error->message);
+            modem_op_state_answered (modem_object, FALSE);
+        }
+    } else
+        modem_op_state_answered (modem_object, TRUE);
+
+    g_object_unref (modem_object);
+}
+
+/* Seconds ModemManager gets to answer the op state's call */
+static gint
+modem_context_get_step_timeout (ModemContext *modem_ctx)
+{
+    const Config *config = &modem_ctx->ctx->config;
+
+    switch (modem_ctx->op_state) {
+    case MODEM_OP_STATE_REGISTER:
+        return config->register_timeout;
+    case MODEM_OP_STATE_ENABLE:
+        return config->enable_timeout;
+    default:
+        return config->step_timeout;
+    }
+}
+
+/* ModemManager sat on the op state's call; treat it as failed so that a
+ * single hung call costs its timeout instead of stalling the kick
+ */
+static void
+modem_step_timeout_cb (ModemContext *modem_ctx)
+{
+    modem_ctx->ctx->metrics->step_timeouts[modem_ctx->op_state]++;
+    modem_warning (modem_ctx, "no answer to %s within %d seconds; giving up on it",
+                   op_state_names[modem_ctx->op_state], modem_context_get_step_timeout (modem_ctx));
+    /* the late reply then reports G_IO_ERROR_CANCELLED and gets ignored */
+    g_cancellable_cancel (modem_ctx->cancellable);
+    g_object_unref (modem_ctx->cancellable);
+    modem_ctx->cancellable = g_cancellable_new ();
+    modem_context_drop_slot (modem_ctx);
+    modem_op_state_done (modem_ctx->object, FALSE);
+    modem_schedule_retry_op_state (modem_ctx->object);
+}
+
+/* Gives ModemManager the time the call about to be issued may take */
+static void
+modem_context_arm_step_timer (ModemContext *modem_ctx)
+{
+    scheduler_arm (modem_ctx->ctx->scheduler, &modem_ctx->step_timer,
+                   modem_ctx->op_started + (gint64) modem_context_get_step_timeout (modem_ctx) * G_USEC_PER_SEC);
+}
+
+/* Hands the op state's call to the fake ModemManager, if there is one */
+static gboolean
+modem_context_fake_call (ModemContext *modem_ctx)
+{
+    Context *ctx = modem_ctx->ctx;
+
+    if (!ctx->fake_mm)
+        return FALSE;
+    ctx->fake_mm->call (modem_ctx->object, ctx->fake_mm_data);
+    return TRUE;
+}
+
+static void
+modem_op_state_run (MMObject *modem_object)
+{
+    ModemContext      *modem_ctx = get_modem_context (modem_object);
+    g_autoptr(GError)  error = NULL;
+
+    /* the pending call's reply or step_timer moves on, never another run */
+    g_assert (!timer_is_armed (&modem_ctx->step_timer));
+
+    /* only the calls to ModemManager need a slot */
+    if (modem_ctx->op_state != MODEM_OP_STATE_NONE && modem_ctx->op_state != MODEM_OP_STATE_FINISH &&
+        !modem_context_take_slot (modem_ctx))
+        return;
+
+    modem_ctx->op_started = get_monotonic_time ();
+    switch (modem_ctx->op_state) {
+    case MODEM_OP_STATE_NONE:
+        modem_start_tier (modem_object);
+        break;
+    case MODEM_OP_STATE_REGISTER:
+        /* Cheapest remedy: re-scan and register automatically */
+        modem_message (modem_ctx, "re-registering (try %d)...", modem_ctx->tries);
+        modem_context_arm_step_timer (modem_ctx);
+        if (!modem_context_fake_call (modem_ctx))
+            mm_modem_3gpp_register (modem_ctx->modem_3gpp,
+                                    "",
+                                    modem_ctx->cancellable,
+                                    (GAsyncReadyCallback) modem_register_ready,
+                                    g_object_ref (modem_object));
+        break;
+    case MODEM_OP_STATE_DISABLE:
+        modem_message (modem_ctx, "disabling (try %d)...", modem_ctx->tries);
+        modem_context_arm_step_timer (modem_ctx);
+        if (!modem_context_fake_call (modem_ctx))
+            mm_modem_disable (modem_ctx->modem,
+                              modem_ctx->cancellable,
+                              (GAsyncReadyCallback) modem_disable_ready,
+                              g_object_ref (modem_object));
+        break;
+    case MODEM_OP_STATE_LOW_POWER:
+        /* Once disabled, move to low-power mode */
+        modem_message (modem_ctx, "setting low-power mode (try %d)...", modem_ctx->tries);
+        modem_context_arm_step_timer (modem_ctx);
+        if (!modem_context_fake_call (modem_ctx))
+            mm_modem_set_power_state (modem_ctx->modem,
+                                      MM_MODEM_POWER_STATE_LOW,
+                                      modem_ctx->cancellable,
+                                      (GAsyncReadyCallback) set_power_state_low_ready,
+                                      g_object_ref (modem_object));
+        break;
+    case MODEM_OP_STATE_ENABLE:
+        /* Try to re-enable the modem */
+        modem_message (modem_ctx, "re-enabling (try %d)...", modem_ctx->tries);
+        modem_context_arm_step_timer (modem_ctx);
+        if (!modem_context_fake_call (modem_ctx))
+            mm_modem_enable (modem_ctx->modem,
+                             modem_ctx->cancellable,
+                             (GAsyncReadyCallback) modem_enable_ready,
+                             g_object_ref (modem_object));
+        break;
+    case MODEM_OP_STATE_CUT_POWER:
+        /* Last resort, for modems that don't answer ModemManager any more */
+        modem_message (modem_ctx, "cutting power (%s, try %d)...", modem_ctx->ctx->config.power_backend, modem_ctx->tries);
+        if (modem_context_fake_call (modem_ctx))
+            break;
+        if (modem_context_cut_power (modem_ctx, &error))
+            modem_op_state_answered (modem_object, TRUE);
+        else {
+            modem_warning (modem_ctx, "failed to cut power: '%s'", error->message);
+            modem_op_state_answered (modem_object, FALSE);
+        }
+        break;
+    case MODEM_OP_STATE_RESET:
+        /* Most expensive remedy ModemManager has: it re-probes the modem afterwards */
+        modem_message (modem_ctx, "resetting (try %d)...", modem_ctx->tries);
+        modem_context_arm_step_timer (modem_ctx);
+        if (!modem_context_fake_call (modem_ctx))
+            mm_modem_reset (modem_ctx->modem,
+                            modem_ctx->cancellable,
+                            (GAsyncReadyCallback) modem_reset_ready,
+                            g_object_ref (modem_object));
+        break;
+    case MODEM_OP_STATE_FINISH:
+        modem_message (modem_ctx, "modem kicked (%s)", kick_tiers[modem_ctx->tier].name);
+        modem_context_finish_kick (modem_ctx);
+        modem_update_kick_deadline (modem_ctx);
+        break;
+    }
+}
+
+/* Bookkeeping as a kick starts: picks its tier and arms the stall guard */
+static void
+modem_context_begin_kick (ModemContext *modem_ctx)
+{
+    gint64 now;
+    gint64 time_failed;
+
+    now = get_monotonic_time ();
+    time_failed = now - modem_ctx->timestamp;
+    if (modem_ctx->kick_forced)
+        modem_message (modem_ctx, "kick requested; kicking (%s)...", kick_tiers[modem_ctx->next_tier].name);
+    else
+        modem_message (modem_ctx, "idle/denied for %" G_GINT64_FORMAT " seconds; kicking (%s)...",
+                       time_failed / G_USEC_PER_SEC,
+                       kick_tiers[modem_ctx->next_tier].name);
+    modem_ctx->kick_forced = FALSE;
+
+    /* the previous kick didn't work if it's still waiting for registration */
+    modem_context_verify_kick (modem_ctx, FALSE);
+    modem_context_cancel_op (modem_ctx);
+    modem_ctx->cancellable = g_cancellable_new ();
+    modem_ctx->tier = modem_context_pick_tier (modem_ctx, modem_ctx->next_tier);
+    modem_ctx->kick_unverified = TRUE;
+    if (!modem_ctx->kick_started && modem_ctx->timestamp)
+        histogram_observe (&modem_ctx->ctx->metrics->detect, time_failed);
+    modem_ctx->kick_started = now;
+    modem_ctx->unusable_since = now;
+    /* Restart the kick if it hasn't finished by then */
+    modem_ctx->kick_holdoff = now + ((gint64) modem_ctx->ctx->config.repeat_max * G_USEC_PER_SEC);
+}
+
+static void
+modem_kick_start (MMObject *modem_object)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+
+    modem_ctx->hook_approved = FALSE;
+    modem_context_begin_kick (modem_ctx);
+    modem_op_state_run (modem_object);
+}
+
+/* Runs waiting op states, oldest first, while there are free slots */
+static void
+context_admit_steps (Context *ctx)
+{
+    while (ctx->calls_running < (guint) ctx->config.max_concurrent && !g_queue_is_empty (&ctx->slot_queue)) {
+        MMObject     *modem_object = g_queue_pop_head (&ctx->slot_queue);
+        ModemContext *modem_ctx = get_modem_context (modem_object);
+
+        modem_ctx->slot_queued = FALSE;
+        modem_op_state_run (modem_object);
+    }
+}
+
+static gdouble
+context_get_kick_rate (Context *ctx)
+{
+    return ctx->kick_rate >= 0 ? ctx->kick_rate : ctx->config.kick_rate;
+}
+
+/* Whether the kick rate limit lets a kick start now; if not, kick_timer is
+ * armed for when it will.
+ */
+static gboolean
+modem_context_take_kick_token (ModemContext *modem_ctx, gint64 now)
+{
+    Context *ctx = modem_ctx->ctx;
+    gdouble  rate = context_get_kick_rate (ctx);
+    gint64   wait;
+
+    if (rate <= 0)
+        return TRUE;
+    wait = token_bucket_take (&ctx->kick_tokens, rate / 3600, ctx->config.kick_burst, now);
+    if (wait == 0)
+        return TRUE;
+
+    ctx->metrics->rate_limited++;
+    modem_message (modem_ctx, "kick rate limit reached; kicking in %" G_GINT64_FORMAT " seconds",
+                   (wait + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC);
+    scheduler_arm (ctx->scheduler, &modem_ctx->kick_timer, now + wait);
+    return FALSE;
+}
+
+/* Kick deadline reached: kick now. A kick still running by then has
+ * stalled and is restarted.
+ */
+static void
+modem_kick_cb (MMObject *modem_object)
+{
+    ModemContext *modem_ctx = get_modem_context (modem_object);
+    gboolean      kicking = modem_ctx->op_state != MODEM_OP_STATE_NONE;
+    gint64        now = get_monotonic_time ();
+
+    if (!kicking && modem_context_get_kick_deadline (modem_ctx, now) > now) {
+        modem_update_kick_deadline (modem_ctx);
+        return;
+    }
+    if (!kicking && !modem_ctx->hook_approved && !modem_ctx->kick_forced &&
+        modem_context_run_hook (modem_ctx))
+        return;
+    if (!kicking && !modem_ctx->kick_forced && !modem_context_take_kick_token (modem_ctx, now))
+        return;
+
+    modem_kick_start (modem_object);
+}
+
+/* Returns when the modem is due a kick: when it crosses the threshold of its
+ * idle/denied registration state, or has been idle/denied for long enough
+ * within the flapping window. A modem that is still idle/denied after a
+ * kick is kicked again once kick_holdoff has passed. Without signal the
+ * kick is postponed. Returns -1 if there is nothing to kick for.
+ */
+static gint64
+modem_context_get_kick_deadline (ModemContext *modem_ctx, gint64 now)
+{
+    const Config *config = &modem_ctx->ctx->config;
+    gint64        deadline;
+
+    if (modem_ctx->kick_forced)
+        return now;
+    if (modem_ctx->timestamp == 0 || (modem_ctx->no_signal && config->no_signal_delay < 0))
+        return -1;
+
+    deadline = modem_ctx->timestamp + ((gint64) modem_ctx->threshold * G_USEC_PER_SEC) + modem_ctx->stagger;
+    if (config->flap_threshold > 0) {
+        gboolean unusable_now;
+        gint64   missing;
+
+        /* Assumes it stays unusable, and that no older unusable time leaves
+         * the window meanwhile; modem_kick_cb checks again.
+         */
+        missing = (gint64) config->flap_threshold * G_USEC_PER_SEC -
+                  modem_context_get_unusable_time (modem_ctx, now, &unusable_now);
+        if (unusable_now)
+            deadline = MIN (deadline, missing > 0 ? now + MAX (missing, G_USEC_PER_SEC) : now);
+    }
+    if (modem_ctx->no_signal)
+        deadline += (gint64) config->no_signal_delay * G_USEC_PER_SEC;
+    return MAX (deadline, modem_ctx->kick_holdoff);
+}
+
+static void
+modem_update_kick_deadline (ModemContext *modem_ctx)
+{
+    gint64 now;
+    gint64 deadline;
+    guint  seconds;
+
+    now = get_monotonic_time ();
+    deadline = modem_context_get_kick_deadline (modem_ctx, now);
+    if (deadline < 0) {
+        if (timer_is_armed (&modem_ctx->kick_timer))
+            modem_message (modem_ctx, "canceling kick%s", modem_ctx->timestamp ? " while there is no signal" : "");
+        modem_context_cancel_kick (modem_ctx);
+        return;
+    }
+    deadline = MAX (deadline, now);
+
+    if (timer_is_armed (&modem_ctx->kick_timer) && modem_ctx->kick_timer.deadline == deadline)
+        return;
+
+    seconds = (deadline - now + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC;
+    modem_message (modem_ctx, "kicking in %u seconds unless registration recovers", seconds);
+    scheduler_arm (modem_ctx->ctx->scheduler, &modem_ctx->kick_timer, deadline);
+}
+
+/* Loads the config file, applies command line overrides and re-evaluates
+ * every modem's deadlines against the result. On error the old config stays.
+ */
+static gboolean
+context_load_config (Context *ctx, GError **error)
+{
+    Config          config;
+    GHashTableIter  iter;
+    gpointer        value;
+    guint           i;
+
+    config_init (&config);
+    if (!config_load_file (&config, ctx->config_path, error)) {
+        g_prefix_error (error, "%s: ", ctx->config_path);
+        config_clear (&config);
+        return FALSE;
+    }
+    for (i = 0; i < N_KICK_THRESHOLDS; i++) {
+        guint j;
+
+        if (ctx->threshold_overrides[i] < 0)
+            continue;
+        config.thresholds[i] = ctx->threshold_overrides[i];
+        for (j = 0; j < config.profiles->len; j++)
+            ((Profile *) g_ptr_array_index (config.profiles, j))->thresholds[i] = -1;
+    }
+    if (!config_validate (&config, error)) {
+        g_prefix_error (error, "%s: ", ctx->config_path);
+        config_clear (&config);
+        return FALSE;
+    }
+    config_clear (&ctx->config);
+    ctx->config = config;
+    scheduler_set_slack (ctx->scheduler, ctx->config.timer_slack);
+
+    g_hash_table_iter_init (&iter, ctx->modems);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        MMObject *modem_object = value;
+
+        modem_context_configure (get_modem_context (modem_object));
+        modem_update_registration (modem_object);
+    }
+    /* the limit may have been raised */
+    context_admit_steps (ctx);
+    /* a replay serves nothing, and mustn't take over the daemon's socket */
+    if (!time_is_virtual)
+        context_update_metrics_socket (ctx);
+    return TRUE;
+}
+
+/* Metrics endpoint: answers every connection with a single HTTP response
+ * carrying metrics_render() and closes it; the request itself is ignored,
+ * and only its first sizeof (request) bytes are read.
+ */
+
+typedef struct {
+    Context           *ctx;
+    GSocketConnection *connection;
+    gchar              request[1024];
+    gchar             *response;
+} MetricsRequest;
+
+static void
+metrics_request_free (MetricsRequest *request)
+{
+    request->ctx->metrics_clients--;
+    g_object_unref (request->connection);
+    g_free (request->response);
+    g_slice_free (MetricsRequest, request);
+}
+
+static void
+metrics_write_ready (GOutputStream *stream, GAsyncResult *res, MetricsRequest *request)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!g_output_stream_write_all_finish (stream, res, NULL, &error))
+        g_message ("metrics: failed to send response: %s", error->message);
+    metrics_request_free (request);
+}
+
+static void
+metrics_read_ready (GInputStream *stream, GAsyncResult *res, MetricsRequest *request)
+{
+    g_autoptr(GError)  error = NULL;
+    g_autofree gchar  *body = NULL;
+
+    if (g_input_stream_read_finish (stream, res, &error) < 0) {
+        g_message ("metrics: failed to read request: %s", error->message);
+        metrics_request_free (request);
+        return;
+    }
+
+    body = metrics_render (request->ctx);
+    request->response = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+                                         "Content-Type: text/plain; version=0.0.4\r\n"
+                                         "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+                                         "Connection: close\r\n"
+                                         "\r\n"
+                                         "%s",
+                                         strlen (body), body);
+    g_output_stream_write_all_async (g_io_stream_get_output_stream (G_IO_STREAM (request->connection)),
+                                     request->response,
+                                     strlen (request->response),
+                                     G_PRIORITY_DEFAULT,
+                                     NULL,
+                                     (GAsyncReadyCallback) metrics_write_ready,
+                                     request);
+}
+
+static gboolean
+metrics_incoming (GSocketService *service, GSocketConnection *connection, GObject *source, Context *ctx)
+{
+    MetricsRequest *request;
+
+    /* dropping the connection closes it */
+    if (ctx->metrics_clients >= METRICS_MAX_CLIENTS) {
+        g_message ("metrics: already serving %u clients; dropping connection", ctx->metrics_clients);
+        return TRUE;
+    }
+    /* an idle or slow client mustn't hold its connection forever; the
+     * timeout covers the pending read and write too
+     */
+    g_socket_set_timeout (g_socket_connection_get_socket (connection), METRICS_TIMEOUT_SECONDS);
+
+    ctx->metrics_clients++;
+    request = g_slice_new0 (MetricsRequest);
+    request->ctx = ctx;
+    request->connection = g_object_ref (connection);
+    g_input_stream_read_async (g_io_stream_get_input_stream (G_IO_STREAM (connection)),
+                               request->request,
+                               sizeof (request->request),
+                               G_PRIORITY_DEFAULT,
+                               NULL,
+                               (GAsyncReadyCallback) metrics_read_ready,
+                               request);
+    return TRUE;
+}
+
+/* (Re)opens the metrics endpoint if config.metrics_socket changed. Failing
+ * to listen only costs the metrics, so it is logged rather than fatal.
+ */
+static void
+context_update_metrics_socket (Context *ctx)
+{
+    const gchar               *path = ctx->config.metrics_socket;
+    g_autoptr(GSocketAddress)  address = NULL;
+    g_autoptr(GError)          error = NULL;
+
+    if (g_strcmp0 (path ? path : "", ctx->metrics_socket ? ctx->metrics_socket : "") == 0)
+        return;
+
+    if (ctx->metrics_service) {
+        g_message ("metrics: closing %s", ctx->metrics_socket);
+        g_socket_service_stop (ctx->metrics_service);
+        g_socket_listener_close (G_SOCKET_LISTENER (ctx->metrics_service));
+        g_clear_object (&ctx->metrics_service);
+        g_unlink (ctx->metrics_socket);
+    }
+    g_clear_pointer (&ctx->metrics_socket, g_free);
+
+    if (!path || !*path)
+        return;
+
+    /* a previous instance may have left its socket behind */
+    g_unlink (path);
+    ctx->metrics_service = g_socket_service_new ();
+    address = g_unix_socket_address_new (path);
+    if (!g_socket_listener_add_address (G_SOCKET_LISTENER (ctx->metrics_service),
+                                        address,
+                                        G_SOCKET_TYPE_STREAM,
+                                        G_SOCKET_PROTOCOL_DEFAULT,
+                                        NULL,
+                                        NULL,
+                                        &error)) {
+        g_warning ("Error: failed to listen on %s for metrics: %s", path, error->message);
+        g_clear_object (&ctx->metrics_service);
+        return;
+    }
+    g_signal_connect (ctx->metrics_service, "incoming", G_CALLBACK (metrics_incoming), ctx);
+    g_socket_service_start (ctx->metrics_service);
+    ctx->metrics_socket = g_strdup (path);
+    g_message ("metrics: serving on %s", path);
+}
+
+/*****************************************************************************/
+/* D-Bus service: lets operators see what the daemon makes of each modem and
+ * kick or spare one without waiting for its threshold. Who may call what is
+ * up to the bus policy (org.jucr.ModemKick.conf).
+ */
+
+#define SERVICE_NAME "org.jucr.ModemKick"
+#define SERVICE_PATH "/org/jucr/ModemKick"
+
+static const gchar service_xml[] =
+    "<node>"
+    "  <interface name='org.jucr.ModemKick'>"
+    "    <method name='GetModems'>"
+    "      <arg type='a{oa{sv}}' name='modems' direction='out'/>"
+    "    </method>"
+    "    <method name='GetStats'>"
+    "      <arg type='a{sv}' name='stats' direction='out'/>"
+    "    </method>"
+    "    <method name='KickNow'>"
+    "      <arg type='o' name='modem' direction='in'/>"
+    "    </method>"
+    "    <method name='Cancel'>"
+    "      <arg type='o' name='modem' direction='in'/>"
+    "    </method>"
+    "    <property name='KickRate' type='d' access='readwrite'>"
+    "      <annotation name='org.freedesktop.DBus.Property.EmitsChangedSignal' value='false'/>"
+    "    </property>"
+    "  </interface>"
+    "</node>";
+
+static GVariant *
+modem_context_get_status (ModemContext *modem_ctx)
+{
+    GVariantBuilder builder;
+    gint64          now = get_monotonic_time ();
+    gint64          deadline;
+    OpState         op_state = modem_ctx->op_state;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    if (modem_ctx->equipment_id)
+        g_variant_builder_add (&builder, "{sv}", "equipment-id", g_variant_new_string (modem_ctx->equipment_id));
+    if (modem_ctx->source)
+        g_variant_builder_add (&builder, "{sv}", "source", g_variant_new_string (modem_ctx->source->name));
+    if (modem_ctx->model)
+        g_variant_builder_add (&builder, "{sv}", "model", g_variant_new_string (modem_ctx->model));
+    if (modem_ctx->profile)
+        g_variant_builder_add (&builder, "{sv}", "profile", g_variant_new_string (modem_ctx->profile));
+    /* seconds */
+    if (modem_ctx->timestamp)
+        g_variant_builder_add (&builder, "{sv}", "failing-for",
+                               g_variant_new_int64 ((now - modem_ctx->timestamp) / G_USEC_PER_SEC));
+    deadline = modem_context_get_kick_deadline (modem_ctx, now);
+    if (deadline >= 0 && op_state == MODEM_OP_STATE_NONE)
+        g_variant_builder_add (&builder, "{sv}", "kick-in",
+                               g_variant_new_int64 ((MAX (deadline, now) - now) / G_USEC_PER_SEC));
+    g_variant_builder_add (&builder, "{sv}", "waiting-for-slot", g_variant_new_boolean (modem_ctx->slot_queued));
+    g_variant_builder_add (&builder, "{sv}", "hook-running", g_variant_new_boolean (modem_ctx->hook != NULL));
+    g_variant_builder_add (&builder, "{sv}", "data-stalled", g_variant_new_boolean (modem_ctx->data_stalled));
+    g_variant_builder_add (&builder, "{sv}", "next-tier", g_variant_new_string (kick_tiers[modem_ctx->next_tier].name));
+    if (modem_ctx->reject)
+        g_variant_builder_add (&builder, "{sv}", "reject-cause", g_variant_new_string (modem_ctx->reject->name));
+    if (op_state != MODEM_OP_STATE_NONE) {
+        g_variant_builder_add (&builder, "{sv}", "tier", g_variant_new_string (kick_tiers[modem_ctx->tier].name));
+        g_variant_builder_add (&builder, "{sv}", "op-state",
+                               g_variant_new_string (op_state_names[op_state] ? op_state_names[op_state] : "finish"));
+        g_variant_builder_add (&builder, "{sv}", "tries", g_variant_new_uint32 (modem_ctx->tries));
+    }
+    return g_variant_builder_end (&builder);
+}
+
+static GVariant *
+service_get_tier_counts (const guint64 counts[N_KICK_TIERS])
+{
+    GVariantBuilder builder;
+    guint           i;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{st}"));
+    for (i = 0; i < N_KICK_TIERS; i++)
+        g_variant_builder_add (&builder, "{st}", kick_tiers[i].name, counts[i]);
+    return g_variant_builder_end (&builder);
+}
+
+/* Timer wakeups an hour since the daemon started */
+static gdouble
+context_get_wakeup_rate (Context *ctx)
+{
+    gint64 uptime = get_monotonic_time () - ctx->started;
+
+    return uptime > 0 ? ctx->scheduler->wakeups * 3600.0 * G_USEC_PER_SEC / uptime : 0;
+}
+
+static GVariant *
+context_get_stats (Context *ctx)
+{
+    GVariantBuilder  builder;
+    const Metrics   *metrics = ctx->metrics;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "modems", g_variant_new_uint32 (g_hash_table_size (ctx->modems)));
+    g_variant_builder_add (&builder, "{sv}", "calls-running", g_variant_new_uint32 (ctx->calls_running));
+    g_variant_builder_add (&builder, "{sv}", "calls-queued", g_variant_new_uint32 (g_queue_get_length (&ctx->slot_queue)));
+    g_variant_builder_add (&builder, "{sv}", "timer-wakeups", g_variant_new_uint64 (ctx->scheduler->wakeups));
+    g_variant_builder_add (&builder, "{sv}", "timer-wakeups-per-hour", g_variant_new_double (context_get_wakeup_rate (ctx)));
+    g_variant_builder_add (&builder, "{sv}", "registration-changes", g_variant_new_uint64 (metrics->registration_changes));
+    g_variant_builder_add (&builder, "{sv}", "escalations", g_variant_new_uint64 (metrics->escalations));
+    g_variant_builder_add (&builder, "{sv}", "step-retries", g_variant_new_uint64 (metrics->step_retries));
+    g_variant_builder_add (&builder, "{sv}", "kicks", service_get_tier_counts (metrics->kicks));
+    g_variant_builder_add (&builder, "{sv}", "kick-successes", service_get_tier_counts (metrics->kick_successes));
+    g_variant_builder_add (&builder, "{sv}", "kick-failures", service_get_tier_counts (metrics->kick_failures));
+    return g_variant_builder_end (&builder);
+}
+
+/* Kicks the modem right away, failing or not; the hook isn't asked and
+ * neither threshold nor backoff apply.
+ */
+static void
+modem_context_kick_now (ModemContext *modem_ctx)
+{
+    modem_message (modem_ctx, "kick requested over D-Bus");
+    modem_context_cancel_hook (modem_ctx);
+    modem_ctx->kick_forced = TRUE;
+    modem_update_kick_deadline (modem_ctx);
+}
+
+/* Stops a running or pending kick; a failing modem's failure clock starts
+ * over, so it gets its full threshold before the next one.
+ */
+static void
+modem_context_cancel (ModemContext *modem_ctx)
+{
+    modem_message (modem_ctx, "kick canceled over D-Bus");
+    modem_context_cancel_kick (modem_ctx);
+    if (modem_ctx->op_state != MODEM_OP_STATE_NONE) {
+        modem_context_cancel_op (modem_ctx);
+        modem_context_release_slot (modem_ctx);
+        /* an aborted kick says nothing about the tier */
+        modem_ctx->kick_unverified = FALSE;
+    }
+    if (modem_ctx->timestamp)
+        modem_ctx->timestamp = get_monotonic_time ();
+    modem_ctx->kick_holdoff = 0;
+    modem_context_store_state (modem_ctx);
+    modem_update_kick_deadline (modem_ctx);
+}
+
+static void
+service_method_call (GDBusConnection       *connection,
+                     const gchar           *sender,
+                     const gchar           *object_path,
+                     const gchar           *interface_name,
+                     const gchar           *method_name,
+                     GVariant              *parameters,
+                     GDBusMethodInvocation *invocation,
+                     gpointer               user_data)
+{
+    Context      *ctx = user_data;
+    const gchar  *path = NULL;
+    MMObject     *modem_object;
+    ModemContext *modem_ctx;
+
+    if (g_str_equal (method_name, "GetModems")) {
+        GVariantBuilder builder;
+        GHashTableIter  iter;
+        gpointer        key, value;
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{oa{sv}}"));
+        g_hash_table_iter_init (&iter, ctx->modems);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            g_variant_builder_add (&builder, "{o@a{sv}}", key, modem_context_get_status (get_modem_context (value)));
+        g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@a{oa{sv}})", g_variant_builder_end (&builder)));
+        return;
+    }
+    if (g_str_equal (method_name, "GetStats")) {
+        g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@a{sv})", context_get_stats (ctx)));
+        return;
+    }
+
+    g_variant_get (parameters, "(&o)", &path);
+    modem_object = g_hash_table_lookup (ctx->modems, path);
+    if (!modem_object) {
+        g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_OBJECT,
+                                               "%s is not a modem being watched", path);
+        return;
+    }
+    modem_ctx = get_modem_context (modem_object);
+
+    if (g_str_equal (method_name, "KickNow")) {
+        if (modem_ctx->op_state != MODEM_OP_STATE_NONE) {
+            g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                                   "%s is being kicked already", path);
+            return;
+        }
+        modem_context_kick_now (modem_ctx);
+    } else
+        modem_context_cancel (modem_ctx);
+    g_dbus_method_invocation_return_value (invocation, NULL);
+}
+
+/* KickRate: kicks an hour, overriding config.kick_rate once set */
+static GVariant *
+service_get_property (GDBusConnection  *connection,
+                      const gchar      *sender,
+                      const gchar      *object_path,
+                      const gchar      *interface_name,
+                      const gchar      *property_name,
+                      GError          **error,
+                      gpointer          user_data)
+{
+    Context *ctx = user_data;
+
+    return g_variant_new_double (context_get_kick_rate (ctx));
+}
+
+static gboolean
+service_set_property (GDBusConnection  *connection,
+                      const gchar      *sender,
+                      const gchar      *object_path,
+                      const gchar      *interface_name,
+                      const gchar      *property_name,
+                      GVariant         *value,
+                      GError          **error,
+                      gpointer          user_data)
+{
+    Context *ctx = user_data;
+    gdouble  rate = g_variant_get_double (value);
+
+    /* as config_validate checks [kick] rate */
+    if (!isfinite (rate) || rate < 0) {
+        g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                     "invalid kick rate %g: must be a finite number, 0 or more", rate);
+        return FALSE;
+    }
+    ctx->kick_rate = rate;
+    g_message ("kick rate set to %g an hour", rate);
+    return TRUE;
+}
+
+static const GDBusInterfaceVTable service_vtable = {
+    .method_call = service_method_call,
+    .get_property = service_get_property,
+    .set_property = service_set_property,
+};
+
+static void
+service_name_lost (GDBusConnection *connection, const gchar *name, gpointer user_data)
+{
+    /* only costs the control interface; kicks don't need it */
+    g_warning ("Error: couldn't own %s on the bus; D-Bus control unavailable", name);
+}
+
+/* Exports the service on ctx->connection */
+static void
+context_export (Context *ctx)
+{
+    g_autoptr(GDBusNodeInfo) info = NULL;
+    g_autoptr(GError)        error = NULL;
+
+    info = g_dbus_node_info_new_for_xml (service_xml, &error);
+    g_assert_no_error (error);
+    ctx->service_object_id = g_dbus_connection_register_object (ctx->connection,
+                                                                SERVICE_PATH,
+                                                                info->interfaces[0],
+                                                                &service_vtable,
+                                                                ctx,
+                                                                NULL,
+                                                                &error);
+    if (!ctx->service_object_id) {
+        g_warning ("Error: failed to export %s: %s", SERVICE_PATH, error->message);
+        return;
+    }
+    ctx->service_name_id = g_bus_own_name_on_connection (ctx->connection,
+                                                         SERVICE_NAME,
+                                                         G_BUS_NAME_OWNER_FLAGS_NONE,
+                                                         NULL,
+                                                         service_name_lost,
+                                                         ctx,
+                                                         NULL);
+}
+
+static void
+context_unexport (Context *ctx)
+{
+    if (ctx->service_name_id) {
+        g_bus_unown_name (ctx->service_name_id);
+        ctx->service_name_id = 0;
+    }
+    if (ctx->service_object_id) {
+        g_dbus_connection_unregister_object (ctx->connection, ctx->service_object_id);
+        ctx->service_object_id = 0;
+    }
+}
+
+/*****************************************************************************/
+/* Replay
+ *
+ * --replay=TRACE runs the kick logic against scripted modems on a virtual
+ * clock, using the configuration as loaded, and reports how long detection
+ * and recovery took. Kicks go through the real machinery (kick timers, rate
+ * limit, slots, op states and their timeouts), but their calls go to a fake
+ * ModemManager that answers them as the trace says, and the trace says how
+ * each modem responds to being kicked.
+ *
+ * Trace lines, with times in seconds since the start of the replay:
+ *
+ *   <time> <registration state>     e.g. "0 denied" or "300 home"
+ *   on-kick <tier> <delay> <state>  <delay> seconds after the first call
+ *                                   of a kick of <tier>, or of a more
+ *                                   expensive one, the modem switches to
+ *                                   <state>
+ *   step <step> <delay>             ModemManager answers <step>'s call
+ *                                   ("disable", ...) after <delay> seconds
+ *                                   (default REPLAY_STEP_SECONDS)
+ *   step <step> fail <delay>        it reports a failure after <delay>
+ *   step <step> hang                it never answers
+ *   modem <name>                    the lines that follow are about another
+ *                                   modem, replayed alongside the others
+ *   end <time>                      when to stop (default: an hour after
+ *                                   the last event)
+ *
+ * Blank lines and lines starting with '#' are ignored. States are named as
+ * by mmcli, tiers as in the log ("re-register", ...).
+ *
+ * --replay-journal=LOG replays the fleet history in `journalctl -o
+ * short-unix -u modem-kick` output instead, one modem (by path) after the
+ * other. Its "registration changed to" lines are the events. A logged kick
+ * that registration came back from within the verify window is taken to
+ * have caused that recovery: the recovery is dropped from the events and
+ * becomes the modem's on-kick reaction to that tier instead, so the
+ * replayed policy only gets it by kicking.
+ *
+ * Either way the report compares the time modems spent unregistered in the
+ * trace (as logged, or without any kicks) with the time they spent
+ * unregistered in the replay. Jitter comes from a fixed seed, so a replay
+ * gives the same output every time.
+ */
+
+/* virtual time of trace time 0; timestamps of 0 mean "not set" */
+#define REPLAY_START ((gint64) G_USEC_PER_SEC)
+
+#define REPLAY_STEP_SECONDS 1
+
+typedef struct {
+    gint64                       time;   /* usec since start */
+    MMModem3gppRegistrationState state;
+} ReplayEvent;
+
+typedef struct {
+    gboolean                     set;
+    gint64                       delay;  /* usec */
+    MMModem3gppRegistrationState state;
+} ReplayReaction;
+
+/* How the fake ModemManager answers a step's call */
+typedef struct {
+    gint64   delay;  /* usec */
+    gboolean fails;
+    gboolean hangs;  /* never answers */
+} ReplayStep;
+
+typedef struct Replay Replay;
+
+typedef struct {
+    Replay         *replay;
+    gchar          *name;    /* NULL for the trace's unnamed modem */
+    GArray         *events;  /* ReplayEvent, in time order */
+    ReplayReaction  reactions[N_KICK_TIERS];
+    ReplayStep      steps[N_OP_STATES];
+
+    /* while replaying: object stands in for ModemManager's, carrying
+     * modem_ctx; event_timer plays events[next_event]
+     */
+    MMObject       *object;
+    ModemContext   *modem_ctx;
+    guint           next_event;
+    Timer           event_timer;
+
+    Timer                        reaction_timer;
+    MMModem3gppRegistrationState reaction_state;
+
+    /* the answer to the pending call, dropped if it has been given up on */
+    Timer         answer_timer;
+    GCancellable *answer_cancellable;
+    gboolean      answer_success;
+
+    /* outage being replayed: from failure clock start to registration */
+    gint64   outage_start;
+    gboolean outage_kicked;
+
+    /* time spent unregistered in the trace and in the replay */
+    gint64   traced_offline;
+    gint64   offline_since;
+    gint64   offline_total;
+} ReplayModem;
+
+struct Replay {
+    Context   *ctx;
+    GPtrArray *modems;  /* ReplayModem, replayed alongside each other */
+    gint64     end;     /* usec since start; -1: default */
+
+    guint    outages;
+    guint    recoveries;
+    guint    detections;
+    gint64   detect_total;
+    gint64   detect_max;
+    gint64   recover_total;
+    gint64   recover_max;
+    guint    still_failing;
+
+    /* time spent unregistered in the trace and in the replay, all modems */
+    gint64   traced_offline;
+    gint64   offline_total;
+
+    /* only the report, not every event; for long journals */
+    gboolean quiet;
+};
+
+static void replay_event_cb (ReplayModem *rmodem);
+static void replay_reaction_cb (ReplayModem *rmodem);
+static void replay_answer_cb (ReplayModem *rmodem);
+
+/* @events: taken over, or NULL for none yet */
+static ReplayModem *
+replay_modem_new (Replay *replay, const gchar *name, GArray *events)
+{
+    ReplayModem *rmodem;
+    guint        i;
+
+    rmodem = g_slice_new0 (ReplayModem);
+    rmodem->replay = replay;
+    rmodem->name = g_strdup (name);
+    rmodem->events = events ? events : g_array_new (FALSE, FALSE, sizeof (ReplayEvent));
+    for (i = 0; i < N_OP_STATES; i++)
+        rmodem->steps[i].delay = (gint64) REPLAY_STEP_SECONDS * G_USEC_PER_SEC;
+    timer_init (&rmodem->event_timer, (TimerFunc) replay_event_cb, rmodem);
+    timer_init (&rmodem->reaction_timer, (TimerFunc) replay_reaction_cb, rmodem);
+    timer_init (&rmodem->answer_timer, (TimerFunc) replay_answer_cb, rmodem);
+    g_ptr_array_add (replay->modems, rmodem);
+    return rmodem;
+}
+
+static void
+replay_modem_free (ReplayModem *rmodem)
+{
+    g_free (rmodem->name);
+    g_array_unref (rmodem->events);
+    g_slice_free (ReplayModem, rmodem);
+}
+
+static gint64
+replay_now (void)
+{
+    return (virtual_time - REPLAY_START) / G_USEC_PER_SEC;
+}
+
+static void replay_log (ReplayModem *rmodem, const gchar *format, ...) G_GNUC_PRINTF (2, 3);
+
+static void
+replay_log (ReplayModem *rmodem, const gchar *format, ...)
+{
+    g_autofree gchar *message = NULL;
+    va_list           args;
+
+    if (rmodem->replay->quiet)
+        return;
+    va_start (args, format);
+    message = g_strdup_vprintf (format, args);
+    va_end (args);
+    if (rmodem->name)
+        g_print ("%6" G_GINT64_FORMAT " s: %s: %s\n", replay_now (), rmodem->name, message);
+    else
+        g_print ("%6" G_GINT64_FORMAT " s: %s\n", replay_now (), message);
+}
+
+static gboolean
+replay_parse_state (const gchar *name, MMModem3gppRegistrationState *state)
+{
+    guint i;
+
+    for (i = MM_MODEM_3GPP_REGISTRATION_STATE_IDLE; i <= MM_MODEM_3GPP_REGISTRATION_STATE_ROAMING_CSFB_NOT_PREFERRED; i++) {
+        if (g_strcmp0 (mm_modem_3gpp_registration_state_get_string (i), name) == 0) {
+            *state = i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static gboolean
+replay_parse_seconds (const gchar *str, gint64 *usec)
+{
+    gchar  *end;
+    gint64  v;
+
+    v = g_ascii_strtoll (str, &end, 10);
+    if (end == str || *end || v < 0 || v > G_MAXINT64 / G_USEC_PER_SEC)
+        return FALSE;
+    *usec = v * G_USEC_PER_SEC;
+    return TRUE;
+}
+
+/* "step <step> <delay>", "step <step> fail <delay>" or "step <step> hang" */
+static gboolean
+replay_parse_step (ReplayModem *rmodem, gchar **tokens, guint n_tokens, GError **error)
+{
+    ReplayStep *step;
+    guint       op_state;
+
+    for (op_state = 0; op_state < N_OP_STATES; op_state++) {
+        if (op_state_names[op_state] && g_str_equal (op_state_names[op_state], tokens[1]))
+            break;
+    }
+    if (op_state == N_OP_STATES) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "unknown step '%s'", tokens[1]);
+        return FALSE;
+    }
+    step = &rmodem->steps[op_state];
+    step->fails = n_tokens == 4 && g_str_equal (tokens[2], "fail");
+    step->hangs = n_tokens == 3 && g_str_equal (tokens[2], "hang");
+    if (!step->hangs && (n_tokens != (step->fails ? 4 : 3) || !replay_parse_seconds (tokens[n_tokens - 1], &step->delay))) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                             "expected step <step> <delay>, step <step> fail <delay> or step <step> hang");
+        return FALSE;
+    }
+    if (step->hangs && op_state == MODEM_OP_STATE_CUT_POWER) {
+        /* cutting power doesn't wait for ModemManager, so nothing times it out */
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "cut-power can't hang");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* The modem the trace is talking about, from its last "modem" line on */
+static ReplayModem *
+replay_get_modem (Replay *replay)
+{
+    if (replay->modems->len == 0)
+        return replay_modem_new (replay, NULL, NULL);
+    return g_ptr_array_index (replay->modems, replay->modems->len - 1);
+}
+
+static gboolean
+replay_parse_line (Replay *replay, gchar **tokens, guint n_tokens, GError **error)
+{
+    ReplayModem *rmodem;
+    ReplayEvent  event;
+    guint        tier;
+    guint        i;
+
+    if (g_str_equal (tokens[0], "modem") && n_tokens == 2) {
+        for (i = 0; i < replay->modems->len; i++) {
+            if (g_strcmp0 (((ReplayModem *) g_ptr_array_index (replay->modems, i))->name, tokens[1]) == 0) {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "modem '%s' given twice", tokens[1]);
+                return FALSE;
+            }
+        }
+        replay_modem_new (replay, tokens[1], NULL);
+        return TRUE;
+    }
+    if (g_str_equal (tokens[0], "end") && n_tokens == 2) {
+        if (!replay_parse_seconds (tokens[1], &replay->end)) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "expected end <time>");
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    rmodem = replay_get_modem (replay);
+    if (g_str_equal (tokens[0], "on-kick") && n_tokens == 4) {
+        for (tier = 0; tier < N_KICK_TIERS; tier++) {
+            if (g_str_equal (kick_tiers[tier].name, tokens[1]))
+                break;
+        }
+        if (tier == N_KICK_TIERS) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "unknown tier '%s'", tokens[1]);
+            return FALSE;
+        }
+        if (!replay_parse_seconds (tokens[2], &rmodem->reactions[tier].delay) ||
+            !replay_parse_state (tokens[3], &rmodem->reactions[tier].state)) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "expected on-kick <tier> <delay> <state>");
+            return FALSE;
+        }
+        rmodem->reactions[tier].set = TRUE;
+        return TRUE;
+    }
+    if (g_str_equal (tokens[0], "step") && n_tokens >= 3)
+        return replay_parse_step (rmodem, tokens, n_tokens, error);
+
+    if (n_tokens != 2 || !replay_parse_seconds (tokens[0], &event.time) || !replay_parse_state (tokens[1], &event.state)) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "expected <time> <registration state>");
+        return FALSE;
+    }
+    if (rmodem->events->len && event.time < g_array_index (rmodem->events, ReplayEvent, rmodem->events->len - 1).time) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "events must be in time order");
+        return FALSE;
+    }
+    g_array_append_val (rmodem->events, event);
+    return TRUE;
+}
+
+static gboolean
+replay_load (Replay *replay, const gchar *path, GError **error)
+{
+    g_autofree gchar  *contents = NULL;
+    g_auto(GStrv)      lines = NULL;
+    guint              i;
+
+    if (!g_file_get_contents (path, &contents, NULL, error))
+        return FALSE;
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        g_auto(GStrv) tokens = NULL;
+        guint         n_tokens = 0;
+        guint         j;
+
+        g_strstrip (lines[i]);
+        if (!*lines[i] || *lines[i] == '#')
+            continue;
+
+        /* drop the empty tokens of repeated separators */
+        tokens = g_strsplit_set (lines[i], " \t", -1);
+        for (j = 0; tokens[j]; j++) {
+            if (*tokens[j])
+                tokens[n_tokens++] = tokens[j];
+            else
+                g_free (tokens[j]);
+        }
+        tokens[n_tokens] = NULL;
+
+        if (!replay_parse_line (replay, tokens, n_tokens, error)) {
+            g_prefix_error (error, "%s:%u: ", path, i + 1);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void
+replay_set_state (ReplayModem *rmodem, MMModem3gppRegistrationState state)
+{
+    Replay       *replay = rmodem->replay;
+    ModemContext *modem_ctx = rmodem->modem_ctx;
+    gint64        now = get_monotonic_time ();
 
-    modem_ctx = g_slice_new0 (ModemContext);
-    modem_ctx->path = mm_object_get_path (modem_object);
-    modem_ctx->modem = modem;
-    modem_ctx->modem_3gpp = modem_3gpp;
+    replay_log (rmodem, "%s", mm_modem_3gpp_registration_state_get_string (state));
+    modem_context_update_registration (modem_ctx, state);
 
-    return modem_ctx;
+    if (!reg_state_is_registered (state) && !rmodem->offline_since) {
+        rmodem->offline_since = now;
+    } else if (reg_state_is_registered (state) && rmodem->offline_since) {
+        rmodem->offline_total += now - rmodem->offline_since;
+        rmodem->offline_since = 0;
+    }
+
+    if (modem_ctx->timestamp && !rmodem->outage_start) {
+        rmodem->outage_start = modem_ctx->timestamp;
+        rmodem->outage_kicked = FALSE;
+        replay->outages++;
+    } else if (!modem_ctx->timestamp && rmodem->outage_start) {
+        gint64 recover = now - rmodem->outage_start;
+
+        replay_log (rmodem, "recovered after %" G_GINT64_FORMAT " s", recover / G_USEC_PER_SEC);
+        replay->recoveries++;
+        replay->recover_total += recover;
+        replay->recover_max = MAX (replay->recover_max, recover);
+        rmodem->outage_start = 0;
+    }
 }
 
 static void
-modem_context_cancel_op (ModemContext *modem_ctx)
+replay_modem_arm_event (ReplayModem *rmodem)
 {
-    modem_ctx->op_state = MODEM_OP_STATE_NONE;
-    g_cancellable_cancel (modem_ctx->cancellable);
-    g_clear_object (&modem_ctx->cancellable);
-    if (modem_ctx->next_id)
-        g_source_remove (modem_ctx->next_id);
-    modem_ctx->next_id = 0;
-    modem_ctx->tries = 0;
+    if (rmodem->next_event < rmodem->events->len)
+        scheduler_arm (rmodem->replay->ctx->scheduler, &rmodem->event_timer,
+                       REPLAY_START + g_array_index (rmodem->events, ReplayEvent, rmodem->next_event).time);
 }
 
 static void
-modem_context_free (ModemContext *modem_ctx)
+replay_event_cb (ReplayModem *rmodem)
 {
-    modem_context_cancel_op (modem_ctx);
-    g_slice_free (ModemContext, modem_ctx);
+    replay_set_state (rmodem, g_array_index (rmodem->events, ReplayEvent, rmodem->next_event++).state);
+    replay_modem_arm_event (rmodem);
 }
 
 static void
-modem_registration_changed (MMModem3gpp *modem_3gpp, GParamSpec *pspec, MMObject *modem_object)
+replay_reaction_cb (ReplayModem *rmodem)
 {
-    ModemContext                 *modem_ctx = get_modem_context (modem_object);
-    MMModem3gppRegistrationState  reg_state;
-
-    reg_state = mm_modem_3gpp_get_registration_state (modem_3gpp);
-    g_message ("%s: registration changed to %s", modem_ctx->path, mm_modem_3gpp_registration_state_get_string (reg_state));
-    if (reg_state == MM_MODEM_3GPP_REGISTRATION_STATE_IDLE || reg_state == MM_MODEM_3GPP_REGISTRATION_STATE_DENIED) {
-        if (modem_ctx->timestamp == 0) {
-            modem_ctx->timestamp = g_get_monotonic_time ();
-            g_message ("%s: save idle/denied timestamp %" G_GINT64_FORMAT, modem_ctx->path, modem_ctx->timestamp);
-        }
-    } else {
-        g_message ("%s: registered; clearing idle/denied timestamp", modem_ctx->path);
-        modem_ctx->timestamp = 0;
-    }
+    replay_set_state (rmodem, rmodem->reaction_state);
 }
 
-/*****************************************************************************/
+/* Fake ModemManager */
 
-static void ensure_manager (Context *ctx);
+static ReplayModem *
+replay_modem_from_object (MMObject *modem_object)
+{
+    return g_object_get_data (G_OBJECT (modem_object), "replay-modem");
+}
 
 static void
-handle_object_added (MMManager *mm, MMObject *modem_object, Context *ctx)
+replay_tier_started (MMObject *modem_object, gpointer user_data)
 {
-    const gchar  *path;
-    MMModem      *modem_iface = NULL;
-    MMModem3gpp  *modem_3gpp_iface = NULL;
-    ModemContext *modem_ctx;
+    ReplayModem  *rmodem = replay_modem_from_object (modem_object);
+    Replay       *replay = rmodem->replay;
+    ModemContext *modem_ctx = rmodem->modem_ctx;
+    gint64        now = get_monotonic_time ();
 
-    path = mm_object_get_path (modem_object);
+    if (!rmodem->outage_kicked && rmodem->outage_start) {
+        gint64 detect = now - rmodem->outage_start;
 
-    /* Ensure we have the 'Modem' interface at least */
-    modem_iface = mm_object_peek_modem (modem_object);
-    if (!modem_iface) {
-        g_warning ("Error: modem %s had no modem interface", path);
-        return;
+        rmodem->outage_kicked = TRUE;
+        replay->detections++;
+        replay->detect_total += detect;
+        replay->detect_max = MAX (replay->detect_max, detect);
     }
+    replay_log (rmodem, "kick (%s)", kick_tiers[modem_ctx->tier].name);
+}
 
-    /* Ensure we have a primary port reported */
-    if (!mm_modem_get_primary_port (modem_iface)) {
-        g_warning ("Error: modem %s had no primary port", path);
-        return;
-    }
+/* Lets the modem respond to the kick, once ModemManager has been told */
+static void
+replay_modem_arm_reaction (ReplayModem *rmodem)
+{
+    gint tier;
 
-    modem_3gpp_iface = mm_object_peek_modem_3gpp (modem_object);
-    if (!modem_3gpp_iface) {
-        g_message ("Ignoring non-3GPP modem %s", path);
-        return;
+    /* the most expensive tier up to this one that the modem responds to */
+    for (tier = rmodem->modem_ctx->tier; tier >= 0; tier--) {
+        if (rmodem->reactions[tier].set) {
+            rmodem->reaction_state = rmodem->reactions[tier].state;
+            scheduler_arm (rmodem->replay->ctx->scheduler, &rmodem->reaction_timer,
+                           get_monotonic_time () + rmodem->reactions[tier].delay);
+            break;
+        }
     }
+}
 
-    g_message ("%s: added", path);
-    modem_ctx = modem_context_new (modem_object, modem_iface, modem_3gpp_iface);
-    g_object_set_data_full (G_OBJECT (modem_object), "modem-context", modem_ctx, (GDestroyNotify) modem_context_free);
+static void
+replay_call (MMObject *modem_object, gpointer user_data)
+{
+    ReplayModem      *rmodem = replay_modem_from_object (modem_object);
+    ModemContext     *modem_ctx = rmodem->modem_ctx;
+    const ReplayStep *step = &rmodem->steps[modem_ctx->op_state];
 
-    modem_ctx->reg_state_changed_id = g_signal_connect (modem_3gpp_iface,
-                                                        "notify::registration-state",
-                                                        G_CALLBACK (modem_registration_changed),
-                                                        modem_object);
-    modem_registration_changed (modem_3gpp_iface, NULL, modem_object);
+    replay_log (rmodem, "%s (try %u)", op_state_names[modem_ctx->op_state], modem_ctx->tries);
+    /* a kick still waiting for a slot hasn't done anything to the modem */
+    if (modem_ctx->step == 0 && modem_ctx->tries == 0)
+        replay_modem_arm_reaction (rmodem);
+    /* a new call means the previous one has been given up on */
+    scheduler_cancel (rmodem->replay->ctx->scheduler, &rmodem->answer_timer);
+    g_clear_object (&rmodem->answer_cancellable);
+    if (step->hangs)
+        return;
 
-    g_hash_table_insert (ctx->modems, g_strdup (path), g_object_ref (modem_object));
+    rmodem->answer_cancellable = g_object_ref (modem_ctx->cancellable);
+    rmodem->answer_success = !step->fails;
+    scheduler_arm (rmodem->replay->ctx->scheduler, &rmodem->answer_timer, get_monotonic_time () + step->delay);
 }
 
 static void
-handle_object_removed (MMManager *manager, MMObject *modem_object, Context *ctx)
+replay_answer_cb (ReplayModem *rmodem)
 {
-    const gchar *path = mm_object_get_path (modem_object);
+    g_autoptr(GCancellable) cancellable = g_steal_pointer (&rmodem->answer_cancellable);
+    ModemContext           *modem_ctx = rmodem->modem_ctx;
 
-    g_message ("%s: removed", path);
-    g_hash_table_remove (ctx->modems, path);
+    /* like a real reply after a timeout or a new kick, it goes nowhere */
+    if (g_cancellable_is_cancelled (cancellable))
+        return;
+    replay_log (rmodem, "%s %s", op_state_names[modem_ctx->op_state], rmodem->answer_success ? "done" : "failed");
+    modem_op_state_answered (rmodem->object, rmodem->answer_success);
 }
 
+static const FakeModemManager replay_mm = {
+    .tier_started = replay_tier_started,
+    .call         = replay_call,
+};
+
+/* @traced says where the trace's offline time comes from */
 static void
-mm_available (Context *ctx)
+replay_report (Replay *replay, const gchar *traced)
 {
-    GList *modems, *l;
+    const Metrics *metrics = replay->ctx->metrics;
+    guint          kicks = 0;
+    guint          i;
 
-    /* Get initial modems */
-    modems = g_dbus_object_manager_get_objects (G_DBUS_OBJECT_MANAGER(ctx->mm));
-    for (l = modems; l; l = g_list_next(l)) {
-        handle_object_added (ctx->mm, MM_OBJECT (l->data), ctx);
-    }
-    g_list_free_full (modems, (GDestroyNotify) g_object_unref);
+    g_print ("\noutages:     %u (%u recovered, %u still failing)\n",
+             replay->outages, replay->recoveries, replay->still_failing);
+    if (replay->detections)
+        g_print ("time to kick:    mean %" G_GINT64_FORMAT " s, max %" G_GINT64_FORMAT " s\n",
+                 replay->detect_total / replay->detections / G_USEC_PER_SEC,
+                 replay->detect_max / G_USEC_PER_SEC);
+    if (replay->recoveries)
+        g_print ("time to recover: mean %" G_GINT64_FORMAT " s, max %" G_GINT64_FORMAT " s\n",
+                 replay->recover_total / replay->recoveries / G_USEC_PER_SEC,
+                 replay->recover_max / G_USEC_PER_SEC);
+    for (i = 0; i < N_KICK_TIERS; i++)
+        kicks += metrics->kicks[i];
+    g_print ("kicks:       %u", kicks);
+    for (i = 0; i < N_KICK_TIERS; i++)
+        g_print ("%s%s %" G_GUINT64_FORMAT, i ? ", " : " (", kick_tiers[i].name, metrics->kicks[i]);
+    g_print (")\n");
+    g_print ("offline:     %" G_GINT64_FORMAT " min %s, %" G_GINT64_FORMAT " min replayed (%" G_GINT64_FORMAT " min saved)\n",
+             replay->traced_offline / G_USEC_PER_SEC / 60, traced,
+             replay->offline_total / G_USEC_PER_SEC / 60,
+             (replay->traced_offline - replay->offline_total) / G_USEC_PER_SEC / 60);
 }
 
-static void
-check_name_owner (Context *ctx)
+/* Time @events spend unregistered until @end */
+static gint64
+replay_get_offline_time (GArray *events, gint64 end)
 {
-    g_autofree gchar *name_owner = NULL;
+    gint64 offline = 0;
+    gint64 since = -1;
+    guint  i;
 
-    name_owner = g_dbus_object_manager_client_get_name_owner (G_DBUS_OBJECT_MANAGER_CLIENT (ctx->mm));
-    if (name_owner) {
-        g_message ("ModemManager is running");
-        mm_available (ctx);
-    } else {
-        g_message ("ModemManager is not running");
+    for (i = 0; i < events->len; i++) {
+        const ReplayEvent *event = &g_array_index (events, ReplayEvent, i);
+
+        if (event->time > end)
+            break;
+        if (!reg_state_is_registered (event->state) && since < 0)
+            since = event->time;
+        else if (reg_state_is_registered (event->state) && since >= 0) {
+            offline += event->time - since;
+            since = -1;
+        }
     }
+    if (since >= 0)
+        offline += end - since;
+    return offline;
 }
 
+/* Gives @rmodem a fresh ModemContext, attached to a stand-in object */
 static void
-handle_name_owner_changed (MMManager *modem_manager, GParamSpec *pspec, Context *ctx)
+replay_modem_start (ReplayModem *rmodem)
 {
-    g_autofree gchar *name_owner = NULL;
+    Context      *ctx = rmodem->replay->ctx;
+    ModemContext *modem_ctx;
 
-    name_owner = g_dbus_object_manager_client_get_name_owner (G_DBUS_OBJECT_MANAGER_CLIENT (ctx->mm));
-    if (!name_owner) {
-        g_message ("ModemManager no longer running");
-        context_clear_modems (ctx);
-    } else {
-        g_message ("ModemManager now running");
+    rmodem->next_event = 0;
+    rmodem->outage_start = 0;
+    rmodem->offline_since = 0;
+    rmodem->offline_total = 0;
 
-        /* Hack: GDBusObjectManagerClient won't signal object events if it was
-         * created while MM was not on the bus. Work around that by recreating the
-         * manager when MM shows up. Or get a fixed GIO.
-         */
-        context_clear_manager (ctx);
-        ensure_manager (ctx);
-    }
+    rmodem->object = g_object_new (MM_TYPE_OBJECT, NULL);
+    g_object_set_data (G_OBJECT (rmodem->object), "replay-modem", rmodem);
+    modem_ctx = rmodem->modem_ctx = modem_context_new (ctx, NULL);
+    modem_ctx->object = rmodem->object;
+    modem_ctx->path = rmodem->name ? rmodem->name : "replay";
+    g_object_set_data (G_OBJECT (rmodem->object), "modem-context", modem_ctx);
+    timer_init (&modem_ctx->kick_timer, (TimerFunc) modem_kick_cb, rmodem->object);
+    timer_init (&modem_ctx->op_timer, (TimerFunc) modem_op_state_run, rmodem->object);
+    replay_modem_arm_event (rmodem);
 }
 
 static void
-modem_manager_new_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+replay_modem_stop (ReplayModem *rmodem)
 {
-    Context           *ctx = user_data;
-    g_autoptr(GError)  error = NULL;
+    Replay       *replay = rmodem->replay;
+    ModemContext *modem_ctx = rmodem->modem_ctx;
+    gint64        now = get_monotonic_time ();
 
-    ctx->mm = mm_manager_new_finish (res, &error);
-    if (!ctx->mm) {
-        g_warning ("Error: failed to connect to ModemManager: %s", error->message);
-        return;
+    if (rmodem->outage_start) {
+        replay_log (rmodem, "end; still failing after %" G_GINT64_FORMAT " s",
+                    (now - rmodem->outage_start) / G_USEC_PER_SEC);
+        replay->still_failing++;
     }
-    g_message ("Watching D-Bus for ModemManager...");
+    if (rmodem->offline_since)
+        rmodem->offline_total += now - rmodem->offline_since;
+    replay->traced_offline += rmodem->traced_offline;
+    replay->offline_total += rmodem->offline_total;
 
-    /* Setup signals in the GDBusObjectManagerClient */
-    ctx->name_owner_changed_id = g_signal_connect (ctx->mm,
-                                                   "notify::name-owner",
-                                                   G_CALLBACK (handle_name_owner_changed),
-                                                   ctx);
-    ctx->object_added_id = g_signal_connect (ctx->mm,
-                                             "object-added",
-                                             G_CALLBACK (handle_object_added),
-                                             ctx);
-    ctx->object_removed_id = g_signal_connect (ctx->mm,
-                                               "object-removed",
-                                               G_CALLBACK (handle_object_removed),
-                                               ctx);
+    scheduler_cancel (replay->ctx->scheduler, &rmodem->event_timer);
+    scheduler_cancel (replay->ctx->scheduler, &rmodem->reaction_timer);
+    scheduler_cancel (replay->ctx->scheduler, &rmodem->answer_timer);
+    g_clear_object (&rmodem->answer_cancellable);
+    modem_context_cancel_kick (modem_ctx);
+    modem_context_cancel_op (modem_ctx);
+    modem_context_free (modem_ctx);
+    rmodem->modem_ctx = NULL;
+    g_clear_object (&rmodem->object);
+}
 
-    check_name_owner (ctx);
+/* Replays the modems' events alongside each other on fresh ModemContexts
+ * until replay->end (usec since start). The stats add up across runs.
+ */
+static void
+replay_run (Replay *replay)
+{
+    Context *ctx = replay->ctx;
+    guint    i;
+
+    virtual_time = REPLAY_START;
+    /* the clock starts over, and with it the kick rate limit */
+    memset (&ctx->kick_tokens, 0, sizeof (ctx->kick_tokens));
+    for (i = 0; i < replay->modems->len; i++)
+        replay_modem_start (g_ptr_array_index (replay->modems, i));
+    scheduler_advance (ctx->scheduler, REPLAY_START + replay->end);
+
+    /* nobody is waiting any more; freeing a slot mustn't start a step */
+    for (i = 0; i < replay->modems->len; i++)
+        ((ReplayModem *) g_ptr_array_index (replay->modems, i))->modem_ctx->slot_queued = FALSE;
+    g_queue_clear (&ctx->slot_queue);
+    for (i = 0; i < replay->modems->len; i++)
+        replay_modem_stop (g_ptr_array_index (replay->modems, i));
 }
 
 static void
-ensure_manager (Context *ctx)
+replay_prepare (Replay *replay, Context *ctx)
 {
-    mm_manager_new (ctx->connection,
-                    G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_DO_NOT_AUTO_START,
-                    ctx->cancellable,
-                    modem_manager_new_cb,
-                    ctx);
+    replay->ctx = ctx;
+    replay->modems = g_ptr_array_new_with_free_func ((GDestroyNotify) replay_modem_free);
+    replay->end = -1;
+
+    /* nothing about a simulated modem belongs in the state file */
+    g_clear_pointer (&ctx->config.state_file, g_free);
+    g_assert (time_is_virtual);
+    ctx->fake_mm = &replay_mm;
+    ctx->fake_mm_data = replay;
+    g_random_set_seed (0);
 }
 
 static void
-bus_get_ready (GObject *source, GAsyncResult *res, gpointer user_data)
+replay_clear (Replay *replay)
 {
-    Context           *ctx = user_data;
+    g_clear_pointer (&replay->modems, g_ptr_array_unref);
+}
+
+/* Runs the trace at @path; returns the exit status */
+static int
+context_replay (Context *ctx, const gchar *path)
+{
+    Replay             replay = { 0 };
     g_autoptr(GError)  error = NULL;
-    GDBusConnection   *connection;
+    guint              i;
 
-    connection = g_bus_get_finish (res, &error);
-    if (!connection) {
-        g_warning ("Error: failed to connect to D-Bus: %s", error->message);
-        g_main_loop_quit (ctx->loop);
-        return;
+    replay_prepare (&replay, ctx);
+    if (!replay_load (&replay, path, &error)) {
+        g_printerr ("%s\n", error->message);
+        replay_clear (&replay);
+        return 1;
     }
-    ctx->connection = connection;
-
-    ensure_manager (ctx);
-}
 
-static gboolean modem_op_state_run (MMObject *modem_object);
-static void modem_schedule_op_state (MMObject *modem_object, OpState new_state);
+    if (replay.end < 0) {
+        replay.end = 0;
+        for (i = 0; i < replay.modems->len; i++) {
+            GArray *events = ((ReplayModem *) g_ptr_array_index (replay.modems, i))->events;
 
-static void
-modem_schedule_retry_op_state (MMObject *modem_object)
-{
-    ModemContext *modem_ctx = get_modem_context (modem_object);
+            if (events->len)
+                replay.end = MAX (replay.end, g_array_index (events, ReplayEvent, events->len - 1).time);
+        }
+        replay.end += (gint64) 3600 * G_USEC_PER_SEC;
+    }
+    for (i = 0; i < replay.modems->len; i++) {
+        ReplayModem *rmodem = g_ptr_array_index (replay.modems, i);
 
-    modem_ctx->tries++;
-    if (modem_ctx->tries > 3) {
-        g_message ("%s: too many retries; failing operation", modem_ctx->path);
-        modem_schedule_op_state (modem_object, MODEM_OP_STATE_FINISH);
-    } else {
-        /* retry same op state */
-        modem_schedule_op_state (modem_object, modem_ctx->op_state);
+        rmodem->traced_offline = replay_get_offline_time (rmodem->events, replay.end);
     }
+    replay_run (&replay);
+    replay_report (&replay, "without kicks");
+
+    replay_clear (&replay);
+    return 0;
 }
 
+/* A kick found in the journal */
+typedef struct {
+    gint64   time;  /* usec since the start of the journal */
+    KickTier tier;
+} JournalKick;
+
+/* One modem's history in the journal */
+typedef struct {
+    gchar  *path;
+    GArray *events;  /* ReplayEvent, in time order */
+    GArray *kicks;   /* JournalKick, in time order */
+    /* messages [log] rate limiting kept out of the journal; registration
+     * changes among them are missing from events
+     */
+    guint   suppressed;
+} JournalModem;
+
 static void
-modem_schedule_op_state (MMObject *modem_object, OpState new_state)
+journal_modem_free (JournalModem *modem)
 {
-    ModemContext *modem_ctx = get_modem_context (modem_object);
-
-    modem_ctx->op_state = new_state;
-    g_assert (modem_ctx->next_id == 0);
-    modem_ctx->next_id = g_timeout_add_seconds (10, (GSourceFunc) modem_op_state_run, modem_object);
+    g_free (modem->path);
+    g_array_unref (modem->events);
+    g_array_unref (modem->kicks);
+    g_slice_free (JournalModem, modem);
 }
 
-static void
-modem_enable_ready (MMModem *modem_iface, GAsyncResult *res, MMObject *modem_object)
+/* Splits a `journalctl -o short-unix` line of a per-modem message into its
+ * time (usec, since the epoch), modem path and message. Returns FALSE for
+ * any other line.
+ */
+static gboolean
+journal_parse_line (gchar *line, gint64 *time, gchar **path, gchar **message)
 {
-    const gchar       *path = mm_object_get_path (modem_object);
-    g_autoptr(GError) error = NULL;
+    gchar  *end;
+    gint64  seconds;
+    gchar  *p;
+    guint   i;
 
-    if (!mm_modem_enable_finish(modem_iface, res, &error)) {
-        g_warning ("Error: %s failed to enable: '%s'", path, error->message);
-        modem_schedule_retry_op_state (modem_object);
-    } else {
-        modem_schedule_op_state (modem_object, MODEM_OP_STATE_FINISH);
-    }
+    seconds = g_ascii_strtoll (line, &end, 10);
+    if (end == line || (*end != '.' && *end != ' ') || seconds < 0 || seconds > G_MAXINT64 / G_USEC_PER_SEC)
+        return FALSE;
+    *time = seconds * G_USEC_PER_SEC;
 
-    g_object_unref (modem_object);
+    /* skip the fraction, the host name and the "modem-kick[pid]:" tag */
+    p = end;
+    for (i = 0; i < 3; i++) {
+        p = strchr (p, ' ');
+        if (!p)
+            return FALSE;
+        while (*p == ' ')
+            p++;
+    }
+    end = strstr (p, ": ");
+    if (!end || end == p)
+        return FALSE;
+    *end = '\0';
+    *path = p;
+    *message = end + 2;
+    return TRUE;
 }
 
-static void
-set_power_state_low_ready (MMModem *modem, GAsyncResult *result, MMObject *modem_object)
+static gboolean
+journal_parse_tier (const gchar *message, KickTier *tier)
 {
-    ModemContext      *modem_ctx = get_modem_context (modem_object);
-    g_autoptr(GError) error = NULL;
+    const gchar *name = strstr (message, "kicking (");
+    guint        i;
 
-    if (!mm_modem_set_power_state_finish (modem, result, &error)) {
-        g_warning ("Error: %s failed to set low-power: '%s'", modem_ctx->path, error->message);
-        modem_schedule_retry_op_state (modem_object);
-    } else {
-        modem_schedule_op_state (modem_object, MODEM_OP_STATE_ENABLE);
+    /* before there were tiers every kick was a power cycle */
+    if (g_str_has_suffix (message, "; kicking...")) {
+        *tier = KICK_TIER_POWER_CYCLE;
+        return TRUE;
     }
+    if (!name)
+        return FALSE;
+    name += strlen ("kicking (");
+    for (i = 0; i < N_KICK_TIERS; i++) {
+        gsize len = strlen (kick_tiers[i].name);
 
-    g_object_unref (modem_object);
+        if (strncmp (name, kick_tiers[i].name, len) == 0 && name[len] == ')') {
+            *tier = i;
+            return TRUE;
+        }
+    }
+    return FALSE;
 }
 
-static void
-modem_disable_ready (MMModem *modem_iface, GAsyncResult *res, MMObject *modem_object)
+/* Reads the journal at @path into JournalModems in order of appearance; times
+ * are since the first line. @end is set to the time of the last line.
+ */
+static GPtrArray *
+journal_load (const gchar *path, gint64 *end, GError **error)
 {
-    ModemContext      *modem_ctx = get_modem_context (modem_object);
-    OpState            next_state = MODEM_OP_STATE_LOW_POWER;
-    g_autoptr(GError)  error = NULL;
+    g_autofree gchar     *contents = NULL;
+    g_auto(GStrv)         lines = NULL;
+    g_autoptr(GPtrArray)  modems = NULL;
+    g_autoptr(GHashTable) by_path = NULL;
+    gint64                start = -1;
+    guint                 i;
 
-    if (!mm_modem_disable_finish (modem_iface, res, &error)) {
-        g_warning ("Error: %s failed to disable: '%s'", modem_ctx->path, error->message);
-        modem_schedule_retry_op_state (modem_object);
-    } else {
-        modem_schedule_op_state (modem_object, next_state);
-    }
+    if (!g_file_get_contents (path, &contents, NULL, error))
+        return NULL;
 
-    g_object_unref (modem_object);
-}
+    modems = g_ptr_array_new_with_free_func ((GDestroyNotify) journal_modem_free);
+    by_path = g_hash_table_new (g_str_hash, g_str_equal);
+    *end = 0;
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        JournalModem *modem;
+        ReplayEvent   event;
+        JournalKick   kick;
+        gboolean      is_kick = FALSE;
+        guint64       suppressed = 0;
+        gchar        *modem_path;
+        gchar        *message;
+        gint64        time;
 
-static gboolean
-modem_op_state_run (MMObject *modem_object)
-{
-    ModemContext *modem_ctx = get_modem_context (modem_object);
+        if (!journal_parse_line (lines[i], &time, &modem_path, &message))
+            continue;
+        if (start < 0)
+            start = time;
+        /* journalctl merges journal files; don't let time go backwards */
+        event.time = MAX (time - start, *end);
+        *end = kick.time = event.time;
 
-    modem_ctx->next_id = 0;
+        if (g_str_has_prefix (message, "registration changed to ")) {
+            g_autofree gchar *name = g_strdup (message + strlen ("registration changed to "));
 
-    switch (modem_ctx->op_state) {
-    case MODEM_OP_STATE_NONE:
-        modem_schedule_op_state (modem_object, MODEM_OP_STATE_DISABLE);
-        break;
-    case MODEM_OP_STATE_DISABLE:
-        g_message ("%s: disabling (try %d)...", modem_ctx->path, modem_ctx->tries);
-        mm_modem_disable (modem_ctx->modem,
-                          modem_ctx->cancellable,
-                          (GAsyncReadyCallback) modem_disable_ready,
-                          g_object_ref (modem_object));
-        break;
-    case MODEM_OP_STATE_LOW_POWER:
-        /* Once disabled, move to low-power mode */
-        g_message ("%s: setting low-power mode (try %d)...", modem_ctx->path, modem_ctx->tries);
-        mm_modem_set_power_state (modem_ctx->modem,
-                                  MM_MODEM_POWER_STATE_LOW,
-                                  modem_ctx->cancellable,
-                                  (GAsyncReadyCallback) set_power_state_low_ready,
-                                  g_object_ref (modem_object));
-        break;
-    case MODEM_OP_STATE_ENABLE:
-        /* Try to re-enable the modem */
-        g_message ("%s: re-enabling (try %d)...", modem_ctx->path, modem_ctx->tries);
-        mm_modem_enable (modem_ctx->modem,
-                         modem_ctx->cancellable,
-                         (GAsyncReadyCallback) modem_enable_ready,
-                         g_object_ref (modem_object));
+            /* "denied (imsi-unknown)" */
+            name[strcspn (name, " ")] = '\0';
+            if (!replay_parse_state (name, &event.state))
+                continue;
+        } else if (journal_parse_tier (message, &kick.tier)) {
+            is_kick = TRUE;
+        } else if (g_str_has_suffix (message, " messages suppressed")) {
+            suppressed = g_ascii_strtoull (message, NULL, 10);
+            if (suppressed == 0)
+                continue;
+        } else
+            continue;
 
-        break;
-    case MODEM_OP_STATE_FINISH:
-        g_message ("%s: modem kicked", modem_ctx->path);
-        modem_context_cancel_op (modem_ctx);
-        break;
+        modem = g_hash_table_lookup (by_path, modem_path);
+        if (!modem) {
+            modem = g_slice_new0 (JournalModem);
+            modem->path = g_strdup (modem_path);
+            modem->events = g_array_new (FALSE, FALSE, sizeof (ReplayEvent));
+            modem->kicks = g_array_new (FALSE, FALSE, sizeof (JournalKick));
+            g_ptr_array_add (modems, modem);
+            g_hash_table_insert (by_path, modem->path, modem);
+        }
+        if (suppressed)
+            modem->suppressed += suppressed;
+        else if (is_kick)
+            g_array_append_val (modem->kicks, kick);
+        else
+            g_array_append_val (modem->events, event);
     }
-
-    return G_SOURCE_REMOVE;
+    if (modems->len == 0) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "%s: no modem-kick registration changes found; expected journalctl -o short-unix output", path);
+        return NULL;
+    }
+    return g_steal_pointer (&modems);
 }
 
-static gboolean
-reset_poll_cb (gpointer user_data)
+/* Turns recoveries that followed a logged kick within @verify into the
+ * modem's reactions to the kick's tier (using their mean delay), and drops
+ * them from its events.
+ */
+static void
+replay_learn_reactions (ReplayModem *rmodem, JournalModem *modem, gint64 verify)
 {
-    Context        *ctx = user_data;
-    GHashTableIter  iter;
-    gpointer        value;
+    gint64 delay_total[N_KICK_TIERS] = { 0 };
+    guint  n_recoveries[N_KICK_TIERS] = { 0 };
+    guint  first = 0;
+    guint  i, j;
 
-    g_hash_table_iter_init (&iter, ctx->modems);
-    while (g_hash_table_iter_next (&iter, NULL, &value)) {
-        MMObject     *modem_object = value;
-        ModemContext *modem_ctx = get_modem_context (modem_object);
-        gint64        now = g_get_monotonic_time ();
-        gint64        time_failed;
+    for (i = 0; i < modem->kicks->len; i++) {
+        const JournalKick *kick = &g_array_index (modem->kicks, JournalKick, i);
+        gint64             next_kick = G_MAXINT64;
 
-#ifdef DEBUG
-        modem_ctx->timestamp = now - 700 * G_USEC_PER_SEC;
-#endif
+        if (i + 1 < modem->kicks->len)
+            next_kick = g_array_index (modem->kicks, JournalKick, i + 1).time;
+        /* both are in time order */
+        while (first < modem->events->len && g_array_index (modem->events, ReplayEvent, first).time < kick->time)
+            first++;
+        for (j = first; j < modem->events->len; j++) {
+            const ReplayEvent *event = &g_array_index (modem->events, ReplayEvent, j);
 
-        if (modem_ctx->timestamp == 0)
+            if (event->time >= next_kick || event->time - kick->time > verify)
+                break;
+            if (reg_state_is_registered (event->state)) {
+                delay_total[kick->tier] += event->time - kick->time;
+                n_recoveries[kick->tier]++;
+                g_array_remove_index (modem->events, j);
+                break;
+            }
+        }
+    }
+    for (i = 0; i < N_KICK_TIERS; i++) {
+        if (!n_recoveries[i])
             continue;
+        rmodem->reactions[i].set = TRUE;
+        rmodem->reactions[i].delay = delay_total[i] / n_recoveries[i];
+        rmodem->reactions[i].state = MM_MODEM_3GPP_REGISTRATION_STATE_HOME;
+    }
+}
 
-        time_failed = now - modem_ctx->timestamp;
-        if (time_failed > (KICK_INTERVAL_SECONDS * G_USEC_PER_SEC)) {
-            g_message ("%s: idle/denied for %" G_GINT64_FORMAT " seconds; kicking...",
-                       modem_ctx->path,
-                       time_failed / G_USEC_PER_SEC);
+/* Replays every modem in the journal at @path; returns the exit status */
+static int
+context_replay_journal (Context *ctx, const gchar *path)
+{
+    Replay               replay = { 0 };
+    g_autoptr(GError)    error = NULL;
+    g_autoptr(GPtrArray) modems = NULL;
+    guint                suppressed = 0;
+    guint                i;
 
-            modem_context_cancel_op (modem_ctx);
-            modem_ctx->cancellable = g_cancellable_new ();
-            modem_op_state_run (modem_object);
-        } else {
-            g_message ("%s: not kicking yet; wait %" G_GINT64_FORMAT " seconds",
-                       modem_ctx->path,
-                       KICK_INTERVAL_SECONDS - (time_failed / G_USEC_PER_SEC));
-        }
+    replay_prepare (&replay, ctx);
+    modems = journal_load (path, &replay.end, &error);
+    if (!modems) {
+        g_printerr ("%s\n", error->message);
+        replay_clear (&replay);
+        return 1;
+    }
+
+    replay.quiet = TRUE;
+    for (i = 0; i < modems->len; i++) {
+        JournalModem *modem = g_ptr_array_index (modems, i);
+        ReplayModem  *rmodem;
+        gint64        traced = replay.traced_offline;
+        gint64        offline = replay.offline_total;
+
+        /* one modem at a time, so that a long journal doesn't pile them up */
+        rmodem = replay_modem_new (&replay, NULL, g_array_ref (modem->events));
+        /* the logged recoveries count as logged, even those kicks caused */
+        rmodem->traced_offline = replay_get_offline_time (modem->events, replay.end);
+        replay_learn_reactions (rmodem, modem, (gint64) ctx->config.verify * G_USEC_PER_SEC);
+        replay_run (&replay);
+        g_ptr_array_set_size (replay.modems, 0);
+        g_print ("%s: offline %" G_GINT64_FORMAT " min as logged, %" G_GINT64_FORMAT " min replayed\n",
+                 modem->path,
+                 (replay.traced_offline - traced) / G_USEC_PER_SEC / 60,
+                 (replay.offline_total - offline) / G_USEC_PER_SEC / 60);
+        if (modem->suppressed)
+            g_print ("%s: %u messages missing to log rate limiting\n", modem->path, modem->suppressed);
+        suppressed += modem->suppressed;
     }
+    replay_report (&replay, "as logged");
+    if (suppressed)
+        g_print ("\nwarning: [log] rate limiting kept %u messages out of the journal; the registration\n"
+                 "changes among them are missing, so the minutes above are only approximate\n",
+                 suppressed);
+    replay_clear (&replay);
+    return 0;
+}
+
+static gboolean
+hup_handler (gpointer user_data)
+{
+    Context           *ctx = user_data;
+    g_autoptr(GError)  error = NULL;
 
+    g_message ("Hangup received; reloading %s...", ctx->config_path);
+    if (!context_load_config (ctx, &error))
+        g_warning ("Error: failed to reload config: %s", error->message);
     return G_SOURCE_CONTINUE;
 }
 
@@ -526,14 +5340,86 @@ term_handler (gpointer user_data)
 
 int main (int argc, char **argv)
 {
-    Context *ctx;
+    Context                   *ctx;
+    g_autoptr(GOptionContext)  option_context = NULL;
+    g_autoptr(GError)          error = NULL;
+    g_autoptr(GPtrArray)       option_strings = NULL;
+    g_autofree gchar          *config_path = NULL;
+    g_autofree gchar          *replay_path = NULL;
+    g_autofree gchar          *journal_path = NULL;
+    GOptionEntry               entries[N_KICK_THRESHOLDS + 4] = { 0 };
+    guint                      i;
 
     ctx = context_new ();
 
+    entries[0].long_name = "config";
+    entries[0].short_name = 'c';
+    entries[0].arg = G_OPTION_ARG_FILENAME;
+    entries[0].arg_data = &config_path;
+    entries[0].description = "Configuration file (default " CONFIG_FILE ")";
+    entries[0].arg_description = "PATH";
+
+    entries[N_KICK_THRESHOLDS + 1].long_name = "replay";
+    entries[N_KICK_THRESHOLDS + 1].arg = G_OPTION_ARG_FILENAME;
+    entries[N_KICK_THRESHOLDS + 1].arg_data = &replay_path;
+    entries[N_KICK_THRESHOLDS + 1].description = "Replay a registration trace on a virtual clock and report kick timing";
+    entries[N_KICK_THRESHOLDS + 1].arg_description = "TRACE";
+
+    entries[N_KICK_THRESHOLDS + 2].long_name = "replay-journal";
+    entries[N_KICK_THRESHOLDS + 2].arg = G_OPTION_ARG_FILENAME;
+    entries[N_KICK_THRESHOLDS + 2].arg_data = &journal_path;
+    entries[N_KICK_THRESHOLDS + 2].description = "Replay logged registration changes (journalctl -o short-unix) and report the offline time";
+    entries[N_KICK_THRESHOLDS + 2].arg_description = "LOG";
+
+    /* --<state>-threshold=SECONDS for each state in kick_thresholds */
+    option_strings = g_ptr_array_new_with_free_func (g_free);
+    for (i = 0; i < N_KICK_THRESHOLDS; i++) {
+        gchar *name;
+        gchar *description;
+
+        name = g_strdup_printf ("%s-threshold", kick_thresholds[i].name);
+        description = g_strdup_printf ("Kick modems %s for longer than this (0 = never, default %u)",
+                                       kick_thresholds[i].name,
+                                       kick_thresholds[i].default_threshold);
+        g_ptr_array_add (option_strings, name);
+        g_ptr_array_add (option_strings, description);
+
+        entries[i + 1].long_name = name;
+        entries[i + 1].arg = G_OPTION_ARG_INT;
+        entries[i + 1].arg_data = &ctx->threshold_overrides[i];
+        entries[i + 1].description = description;
+        entries[i + 1].arg_description = "SECONDS";
+    }
+
+    option_context = g_option_context_new (NULL);
+    g_option_context_set_summary (option_context, "Kicks modems stuck in idle/denied registration");
+    g_option_context_add_main_entries (option_context, entries, NULL);
+    if (!g_option_context_parse (option_context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        context_free (ctx);
+        return 1;
+    }
+    if (config_path) {
+        g_free (ctx->config_path);
+        ctx->config_path = g_steal_pointer (&config_path);
+    }
+    time_is_virtual = (replay_path != NULL || journal_path != NULL);
+    if (!context_load_config (ctx, &error)) {
+        g_printerr ("%s\n", error->message);
+        context_free (ctx);
+        return 1;
+    }
+    if (replay_path || journal_path) {
+        int status = replay_path ? context_replay (ctx, replay_path) : context_replay_journal (ctx, journal_path);
+
+        context_free (ctx);
+        return status;
+    }
+    context_load_state (ctx);
+
     g_unix_signal_add (SIGINT, term_handler, ctx->loop);
     g_unix_signal_add (SIGTERM, term_handler, ctx->loop);
-
-    ctx->reset_poll_id = g_timeout_add_seconds (RESET_POLL_SECONDS, reset_poll_cb, ctx);
+    g_unix_signal_add (SIGHUP, hup_handler, ctx);
 
     g_bus_get (G_BUS_TYPE_SYSTEM, ctx->cancellable, bus_get_ready, ctx);
     g_main_loop_run (ctx->loop);